@@ -1,5 +1,6 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <driver/ledc.h>
 #include <led_strip.h>
 #include <led_strip.h>
@@ -7,9 +8,14 @@
 #include <driver/rmt_rx.h>
 
 #include <esp_task_wdt.h>
+#include <esp_random.h>
 #include <string.h>
+#include <math.h>
 
 #include "dali.h"
+#include "dali_bus.h"
+#include "dali_gear.h"
+#include "dali_search.h"
 #include "util.h"
 #include "platform.h"
 #include "pin_define.h"
@@ -19,10 +25,21 @@
 #define DALI_UART_NUMBER    1
 
 #define DALI_STACK_SIZE          4096
+#define DALI_COMMISSION_STACK_SIZE 4096
 #define DALI_MESSAGE_TOTAL_COUNT 10
 
 #define DALI_RECIEVE_TOTAL_COUNT 1024
 
+// IEC 62386-103 event frame with device/instance addressing:
+// 0AAAAAA0 1IIIIIEE EEEEEEEE, short address A, instance number I, event E.
+#define DALI_EVENT_SCHEME_MASK 0x818000
+#define DALI_EVENT_SCHEME      0x008000
+
+// IEC 62386-301 push button events.
+#define DALI_EVENT_BUTTON_RELEASED    0x00
+#define DALI_EVENT_BUTTON_PRESSED     0x01
+#define DALI_EVENT_BUTTON_SHORT_PRESS 0x02
+
 typedef struct led_rgb_t
 {
   uint8_t r;
@@ -43,11 +60,19 @@ typedef struct dali_t
   uint8_t fade_time;
   uint8_t dimming_curve;
 
+  // The commissioning table, kept in NVS: every gear addressed by this
+  // controller and the random address it had then.
   uint32_t short_address_count;
   uint8_t short_address[64];
+  uint32_t random_address[64];
 
   uint8_t current_brightness;
 
+  // Input pin values from the last sample and the state of the matching
+  // input device instances, combined into one input index.
+  bool local_inputs[3];
+  bool remote_inputs[3];
+
   dali_config_t config;
   dali_config_t temp_config;
 
@@ -63,194 +88,629 @@ typedef struct dali_t
 static StackType_t dali_stack[DALI_STACK_SIZE] = {};
 static StaticTask_t dali_stack_type = {};
 
+static StackType_t dali_commission_stack[DALI_COMMISSION_STACK_SIZE] = {};
+static StaticTask_t dali_commission_stack_type = {};
+static TaskHandle_t g_commission_task = NULL;
+static volatile bool g_commissioning = false;
+
 static dali_t dali = {};
 
 static const int delay_time = 15;
 
-static const uint8_t dali_input_pins[] = { DALI_PIN_0, DALI_PIN_1, DALI_PIN_2 };
-static const uint32_t g_total_filters = 1;
-static const uint32_t g_sample_total_count = 600;
+// Only touched on the bus task.
+static dali_op_t g_input_scene_ops[DALI_GEAR_COUNT + 1] = {};
+static dali_script_t g_input_scene_script = {};
+static bool g_input_scene_busy = false;
+static int16_t g_input_scene_next = -1;
+static uint32_t g_input_event_us = 0;
+static uint32_t g_input_scene_event_us = 0;
 
-static const char* g_rmt_tag = "dali_rmt";
+// Time from an input event until the bus task starts on the scene for it.
+typedef struct dali_latency_t
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+} dali_latency_t;
 
-static rmt_channel_handle_t g_rmt_tx_channel;
-static rmt_channel_handle_t g_rmt_rx_channel;
+static dali_latency_t g_input_latency = {};
 
-static rmt_encoder_handle_t g_rmt_encoder;
+// Share of bus time the background gear poller may take, in percent.
+#define DALI_POLL_BUDGET_PERCENT 10
 
-bool rmt_rx_done_callback(rmt_channel_handle_t rx_chan,
-                          const rmt_rx_done_event_data_t* edata, void* user_ctx)
+// How soon the poller looks again when there is no gear to poll or the bus
+// queue was full.
+#define DALI_POLL_RETRY_MS 1000
+
+// The poller is a chain: the poll timer queues one query, its completion on
+// the bus task starts the timer again. Only one link is ever in flight, so
+// the ops need no lock.
+static dali_op_t g_poll_ops[2] = {};
+static dali_script_t g_poll_script = {};
+static lsx_timer_handle_t g_poll_timer;
+static volatile uint8_t g_poll_budget_percent = DALI_POLL_BUDGET_PERCENT;
+
+typedef enum dali_query_class_t
 {
-  QueueHandle_t receive_queue = (QueueHandle_t)user_ctx;
-  xQueueSendFromISR(receive_queue, edata, NULL);
-  return false;
-}
+  DALI_QUERY_CLASS_YES_NO = 0,
+  DALI_QUERY_CLASS_VALUE,
+  DALI_QUERY_CLASS_ADDRESS,
+  DALI_QUERY_CLASS_COUNT,
+} dali_query_class_t;
+
+// Clean answers that have to match before dali_query0() accepts one, and the
+// most queries it sends trying. An address read back while commissioning
+// ends up programmed, so it needs more agreement than a level.
+typedef struct dali_vote_policy_t
+{
+  uint8_t agree;
+  uint8_t max_samples;
+} dali_vote_policy_t;
 
-QueueHandle_t receive_queue = NULL;
+#define DALI_VOTE_MAX_SAMPLES 8
 
-rmt_rx_event_callbacks_t callbacks = {
-  .on_recv_done = rmt_rx_done_callback,
+static const dali_vote_policy_t g_vote_policy[DALI_QUERY_CLASS_COUNT] = {
+  [DALI_QUERY_CLASS_YES_NO] = { 1, 3 },
+  [DALI_QUERY_CLASS_VALUE] = { 2, 5 },
+  [DALI_QUERY_CLASS_ADDRESS] = { 3, 6 },
 };
 
-static uint8_t get_input_index(bool* filter_values)
+typedef struct dali_query_stats_t
 {
-  uint8_t result = (uint8_t)(filter_values[2]);
-  result <<= 1;
-  result |= (uint8_t)(filter_values[1]);
-  result <<= 1;
-  result |= (uint8_t)(filter_values[0]);
-  return min(result, 7);
-}
+  uint32_t queries;
+  uint32_t samples;
+  uint32_t agreed; // Accepted without an extra sample.
+  uint32_t failed;
+  uint32_t cache_hits;
+} dali_query_stats_t;
+
+static dali_query_stats_t g_query_stats = {};
 
-static void dali_initialize_rmt(void)
+// Answers of dali_query0() by address byte and query opcode. Entries are
+// dropped when a command that changes the answer is sent, and expire after
+// the TTL of the opcode in case another controller changed it.
+#define DALI_QUERY_CACHE_SIZE 64
+#define DALI_QUERY_CACHE_ALL  0x00
+
+#define DALI_QUERY_TTL_LEVEL_MS  (30 * 1000)
+#define DALI_QUERY_TTL_CONFIG_MS (10 * 60 * 1000)
+
+typedef struct dali_query_cache_entry_t
 {
-  receive_queue = xQueueCreate(1, sizeof(rmt_rx_done_event_data_t));
+  uint8_t address;
+  uint8_t command;
+  uint8_t response;
+  bool valid;
+  uint32_t time_ms;
+} dali_query_cache_entry_t;
 
-  rmt_tx_channel_config_t tx_cfg = {
-    .gpio_num = DALI_TX,
-    .clk_src = RMT_CLK_SRC_DEFAULT,
-    .resolution_hz = 1000000,
-    .mem_block_symbols = 64,
-    .trans_queue_depth = 1,
-  };
-  rmt_new_tx_channel(&tx_cfg, &g_rmt_tx_channel);
-  rmt_enable(g_rmt_tx_channel);
-
-  rmt_rx_channel_config_t rx_cfg = {
-    .gpio_num = DALI_RX,
-    .clk_src = RMT_CLK_SRC_DEFAULT,
-    .resolution_hz = 1000000,
-    .mem_block_symbols = 64,
-  };
-  rmt_new_rx_channel(&rx_cfg, &g_rmt_rx_channel);
-  rmt_rx_register_event_callbacks(g_rmt_rx_channel, &callbacks, receive_queue);
-  rmt_enable(g_rmt_rx_channel);
+static dali_query_cache_entry_t g_query_cache[DALI_QUERY_CACHE_SIZE] = {};
 
-  rmt_copy_encoder_config_t encoder_config = {};
-  rmt_new_copy_encoder(&encoder_config, &g_rmt_encoder);
-}
-static void dali_rmt_append_bit(rmt_symbol_word_t* rmt_buffer, uint32_t index,
-                                uint8_t bit)
+// Frames are sent from dali_task, the commissioning task and bus task
+// callbacks, so the cache and g_query_stats are only touched under this.
+static SemaphoreHandle_t g_query_lock;
+
+static inline void dali_query_lock(void)
 {
-  rmt_symbol_word_t* current_symbol = rmt_buffer + index;
-  current_symbol->duration0 = dali.delay;
-  current_symbol->duration1 = dali.delay;
-  current_symbol->level0 = bit;
-  current_symbol->level1 = !bit;
+  xSemaphoreTake(g_query_lock, portMAX_DELAY);
 }
 
-void dali_transmit_(uint8_t address, uint8_t command)
+static inline void dali_query_unlock(void)
 {
-  rmt_symbol_word_t frame[32] = {};
-  uint32_t index = 0;
+  xSemaphoreGive(g_query_lock);
+}
 
-  dali_rmt_append_bit(frame, index++, 1);
+// The commissioning table and the commissioning job are written by the
+// commissioning task, which reads them without this, and read by dali_task,
+// bus task callbacks and the web server, which take a copy under it. Never
+// held across a bus transfer.
+static SemaphoreHandle_t g_table_lock;
 
-  for (int32_t i = 7; i >= 0; i--)
-    dali_rmt_append_bit(frame, index++, (address >> i) & 0x01);
+static inline void dali_table_lock(void)
+{
+  xSemaphoreTake(g_table_lock, portMAX_DELAY);
+}
+
+static inline void dali_table_unlock(void)
+{
+  xSemaphoreGive(g_table_lock);
+}
 
-  for (int32_t i = 7; i >= 0; i--)
-    dali_rmt_append_bit(frame, index++, (command >> i) & 0x01);
+typedef struct dali_table_t
+{
+  uint32_t count;
+  uint8_t short_address[DALI_GEAR_COUNT];
+} dali_table_t;
 
-  rmt_transmit_config_t tx_cfg = { .loop_count = 0 };
-  rmt_transmit(g_rmt_tx_channel, g_rmt_encoder, frame,
-               index * sizeof(rmt_symbol_word_t), &tx_cfg);
-  rmt_tx_wait_all_done(g_rmt_tx_channel, 100);
-  lsx_gpio_write(dali.tx_pin, LSX_GPIO_LOW);
+static void dali_table_get(dali_table_t* table_out)
+{
+  dali_table_lock();
+  table_out->count = min(dali.short_address_count, DALI_GEAR_COUNT);
+  memcpy(table_out->short_address, dali.short_address, table_out->count);
+  dali_table_unlock();
 }
 
-void dali_transmit(uint8_t address, uint8_t command)
+// Adds a gear the commissioning task found to the table.
+static void dali_table_add(uint8_t short_address, uint32_t random_address)
 {
-  rmt_enable(g_rmt_tx_channel);
-  dali_transmit_(address, command);
-  rmt_disable(g_rmt_tx_channel);
+  dali_table_lock();
+  dali.random_address[dali.short_address_count] = random_address;
+  dali.short_address[dali.short_address_count++] = short_address;
+  dali_table_unlock();
 }
 
-static rmt_symbol_word_t raw_symbols[64] = {};
+// 0 for queries that are never cached.
+static uint32_t dali_query_ttl_ms(uint8_t address, uint8_t command)
+{
+  if (((address >= DALI_SPECIAL_FIRST) && (address <= DALI_SPECIAL_LAST)) ||
+      ((address & 0x01) == 0))
+  {
+    return 0;
+  }
+  switch (command)
+  {
+    case DALI_QUERY_ACTUAL_OUTPUT:
+    {
+      return DALI_QUERY_TTL_LEVEL_MS;
+    }
+    case DALI_QUERY_MIN_LEVEL:
+    case DALI_QUERY_MAX_LEVEL:
+    case DALI_QUERY_PHYSICAL_MINIMUM:
+    case DALI_QUERY_POWER_ON_LEVEL:
+    case DALI_QUERY_SYSTEM_FAILURE_LEVEL:
+    case DALI_QUERY_FADE_TIME:
+    case DALI_QUERY_VERSION_NUMBER:
+    case DALI_QUERY_LIGHT_SOURCE_TYPE:
+    case DALI_EX_QUERY_DIMMING_CURVE:
+    {
+      return DALI_QUERY_TTL_CONFIG_MS;
+    }
+    default: break;
+  }
+  return 0;
+}
 
-bool dali_read_response(uint32_t timeout_ms, uint8_t* response_out, bool* any_symbols)
+static dali_query_cache_entry_t* dali_query_cache_find(uint8_t address, uint8_t command)
 {
-  lsx_delay_micro(2000);
+  for (uint32_t i = 0; i < array_size(g_query_cache); ++i)
+  {
+    dali_query_cache_entry_t* entry = &g_query_cache[i];
+    if (entry->valid && (entry->address == address) && (entry->command == command))
+    {
+      return entry;
+    }
+  }
+  return NULL;
+}
 
-  rmt_receive_config_t receive_config = {
-    .signal_range_min_ns = 2000,
-    .signal_range_max_ns = 4000000,
-  };
-  rmt_receive(g_rmt_rx_channel, raw_symbols, sizeof(raw_symbols), &receive_config);
+static bool dali_query_cache_get(uint8_t address, uint8_t command, uint8_t* response_out)
+{
+  bool hit = false;
+  dali_query_lock();
+  dali_query_cache_entry_t* entry = dali_query_cache_find(address, command);
+  if (entry)
+  {
+    if ((lsx_get_millis() - entry->time_ms) >= dali_query_ttl_ms(address, command))
+    {
+      entry->valid = false;
+    }
+    else
+    {
+      (*response_out) = entry->response;
+      g_query_stats.cache_hits++;
+      hit = true;
+    }
+  }
+  dali_query_unlock();
+  return hit;
+}
 
-  rmt_rx_done_event_data_t rx_data = {};
-  BaseType_t queue_result =
-    xQueueReceive(receive_queue, &rx_data, pdMS_TO_TICKS(timeout_ms));
+static void dali_query_cache_put(uint8_t address, uint8_t command, uint8_t response)
+{
+  if (dali_query_ttl_ms(address, command) == 0)
+  {
+    return;
+  }
+  dali_query_lock();
+  dali_query_cache_entry_t* entry = dali_query_cache_find(address, command);
+  for (uint32_t i = 0; !entry && (i < array_size(g_query_cache)); ++i)
+  {
+    if (!g_query_cache[i].valid)
+    {
+      entry = &g_query_cache[i];
+    }
+  }
+  if (!entry)
+  {
+    // Full, the oldest answer goes.
+    entry = &g_query_cache[0];
+    for (uint32_t i = 1; i < array_size(g_query_cache); ++i)
+    {
+      if ((int32_t)(g_query_cache[i].time_ms - entry->time_ms) < 0)
+      {
+        entry = &g_query_cache[i];
+      }
+    }
+  }
+  entry->address = address;
+  entry->command = command;
+  entry->response = response;
+  entry->valid = true;
+  entry->time_ms = lsx_get_millis();
+  dali_query_unlock();
+}
 
-  bool result = false;
+// Group membership is not tracked, so a command to anything but a single
+// short address may reach every device.
+static bool dali_query_cache_reaches(const dali_query_cache_entry_t* entry,
+                                     uint8_t address)
+{
+  if (address & 0x80)
+  {
+    return true;
+  }
+  return (entry->address & 0x80) || ((entry->address >> 1) == (address >> 1));
+}
 
-  uint8_t response = 0;
+static void dali_query_cache_invalidate(uint8_t address, uint8_t command)
+{
+  for (uint32_t i = 0; i < array_size(g_query_cache); ++i)
+  {
+    dali_query_cache_entry_t* entry = &g_query_cache[i];
+    if (dali_query_cache_reaches(entry, address) &&
+        ((command == DALI_QUERY_CACHE_ALL) || (entry->command == command)))
+    {
+      entry->valid = false;
+    }
+  }
+}
 
-  if (queue_result == pdPASS)
+// A level set directly is known without asking. The entry keeps the time of
+// the last real query so the TTL still forces a check now and then.
+static void dali_query_cache_level(uint8_t address, uint8_t level)
+{
+  for (uint32_t i = 0; i < array_size(g_query_cache); ++i)
   {
-    if (rx_data.num_symbols <= 16)
+    dali_query_cache_entry_t* entry = &g_query_cache[i];
+    if (entry->valid && (entry->command == DALI_QUERY_ACTUAL_OUTPUT))
     {
-      uint32_t count = 0;
-      uint8_t values[32] = {};
-      for (uint32_t i = 0; i < rx_data.num_symbols; ++i)
+      if ((address >= DALI_BROADCAST_DP) || (entry->address == (address | 0x01)))
       {
-        rmt_symbol_word_t symbol = rx_data.received_symbols[i];
-        if (symbol.duration0 > 200)
-        {
-          values[count++] = symbol.level0;
-          if (symbol.duration0 > 600)
-          {
-            values[count++] = symbol.level0;
-          }
-        }
-        if (symbol.duration1 > 200)
-        {
-          values[count++] = symbol.level1;
-          if (symbol.duration1 > 600)
-          {
-            values[count++] = symbol.level1;
-          }
-        }
+        entry->response = level;
       }
-      if (count == 17)
+      else if (dali_query_cache_reaches(entry, address))
       {
-        values[count++] = 0;
+        entry->valid = false;
       }
-      if (count == 18)
+    }
+  }
+}
+
+static void dali_query_cache_sent_(uint8_t address, uint8_t command)
+{
+  if ((address >= DALI_SPECIAL_FIRST) && (address <= DALI_SPECIAL_LAST))
+  {
+    // Every cached answer may now belong to another device.
+    if (address == DALI_PROGRAM_SHORT_ADDRESS)
+    {
+      dali_query_cache_invalidate(DALI_BROADCAST, DALI_QUERY_CACHE_ALL);
+    }
+    return;
+  }
+  if ((address & 0x01) == 0)
+  {
+    // Direct arc power, MASK leaves the level alone.
+    if (command != 0xFF)
+    {
+      dali_query_cache_level(address, command);
+    }
+    return;
+  }
+
+  switch (command)
+  {
+    case DALI_OFF:
+    {
+      dali_query_cache_level(address, 0);
+      break;
+    }
+    case DALI_RESET:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_CACHE_ALL);
+      break;
+    }
+    case DALI_SET_SHORT_ADDRESS:
+    {
+      dali_query_cache_invalidate(DALI_BROADCAST, DALI_QUERY_CACHE_ALL);
+      break;
+    }
+    case DALI_SET_MIN_LEVEL:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_MIN_LEVEL);
+      dali_query_cache_invalidate(address, DALI_QUERY_ACTUAL_OUTPUT);
+      break;
+    }
+    case DALI_SET_MAX_LEVEL:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_MAX_LEVEL);
+      dali_query_cache_invalidate(address, DALI_QUERY_ACTUAL_OUTPUT);
+      break;
+    }
+    case DALI_SET_FADE_TIME:
+    case DALI_SET_FADE_RATE:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_FADE_TIME);
+      break;
+    }
+    case DALI_SET_POWER_ON_LEVEL:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_POWER_ON_LEVEL);
+      break;
+    }
+    case DALI_SET_SYSTEM_FAILURE_LEVEL:
+    {
+      dali_query_cache_invalidate(address, DALI_QUERY_SYSTEM_FAILURE_LEVEL);
+      break;
+    }
+    case DALI_EX_SELECT_DIMMING_CURVE:
+    {
+      dali_query_cache_invalidate(address, DALI_EX_QUERY_DIMMING_CURVE);
+      break;
+    }
+    default:
+    {
+      // Steps, recalls and scenes all move the level.
+      if (command < DALI_RESET)
       {
-        for (uint32_t i = 2; i < 18; i += 2)
-        {
-          response <<= 1;
-          if ((values[i] == 1) && (values[i + 1] == 0))
-          {
-            response |= 1;
-          }
-        }
-        result = true;
+        dali_query_cache_invalidate(address, DALI_QUERY_ACTUAL_OUTPUT);
       }
-      else
+      break;
+    }
+  }
+}
+
+// Called for every forward frame this controller sends.
+static void dali_query_cache_sent(uint8_t address, uint8_t command)
+{
+  dali_query_lock();
+  dali_query_cache_sent_(address, command);
+  dali_query_unlock();
+}
+
+// Keeps the query cache and the gear model in step with every forward frame
+// this controller sends.
+static void dali_frame_sent(uint8_t address, uint8_t command)
+{
+  dali_query_cache_sent(address, command);
+  dali_gear_sent(address, command);
+}
+
+static const uint8_t dali_input_pins[] = { DALI_PIN_0, DALI_PIN_1, DALI_PIN_2 };
+static const uint32_t g_total_filters = 1;
+static const uint32_t g_sample_total_count = 600;
+
+static const char* g_rmt_tag = "dali_rmt";
+
+static uint8_t get_input_index(bool* filter_values)
+{
+  uint8_t result = (uint8_t)(filter_values[2]);
+  result <<= 1;
+  result |= (uint8_t)(filter_values[1]);
+  result <<= 1;
+  result |= (uint8_t)(filter_values[0]);
+  return min(result, 7);
+}
+
+// A script that did not all get onto the bus leaves the lights it drives
+// unknown: their cached answers are dropped and the poller reads the levels
+// back.
+static void dali_script_sent(const dali_script_t* script, bool sent)
+{
+  for (uint32_t i = 0; i < script->op_count; ++i)
+  {
+    const dali_op_t* op = &script->ops[i];
+    if ((op->type != DALI_OP_FRAME) && (op->type != DALI_OP_SEND_TWICE))
+    {
+      continue;
+    }
+    if (sent)
+    {
+      dali_frame_sent(op->address, op->command);
+    }
+    else
+    {
+      dali_query_lock();
+      dali_query_cache_invalidate(op->address, DALI_QUERY_CACHE_ALL);
+      dali_query_unlock();
+    }
+  }
+}
+
+static void dali_queue_input_scene(uint8_t index);
+
+static void dali_input_scene_done(const dali_frame_t* frame, void* user_data)
+{
+  bool sent = (frame->status == DALI_FRAME_SENT) && (frame->script->failed == 0);
+  dali_script_sent(frame->script, sent);
+
+  uint32_t latency_us =
+    lsx_get_micro() - g_input_scene_event_us - frame->script->duration_us;
+  g_input_latency.count++;
+  g_input_latency.max_us = max(g_input_latency.max_us, latency_us);
+  g_input_latency.total_us += latency_us;
+
+  g_input_scene_busy = false;
+  if (g_input_scene_next >= 0)
+  {
+    uint8_t index = (uint8_t)g_input_scene_next;
+    g_input_scene_next = -1;
+    dali_queue_input_scene(index);
+  }
+}
+
+static bool dali_broadcast_control(void);
+
+// Same lights as the input pins select in dali_task, as one script so it
+// takes a single queue slot.
+static void dali_queue_input_scene(uint8_t index)
+{
+  uint32_t count = 0;
+  if (dali_broadcast_control())
+  {
+    dali_op_t op = dali_op_twice(DALI_BROADCAST_DP, (index != 0) ? 254 : 0);
+    g_input_scene_ops[count++] = op;
+  }
+  dali_table_t table = {};
+  dali_table_get(&table);
+  for (uint32_t i = 0; i < table.count; ++i)
+  {
+    uint8_t short_address = table.short_address[i];
+    dali_op_t op = dali_op_twice(short_address << 1, (index == short_address) ? 254 : 0);
+    g_input_scene_ops[count++] = op;
+  }
+  g_input_scene_script.ops = g_input_scene_ops;
+  g_input_scene_script.op_count = count;
+  g_input_scene_event_us = g_input_event_us;
+
+  // The query cache and the gear model follow in dali_input_scene_done(),
+  // once the bus task has the script on the bus.
+  dali_frame_t frame = {};
+  frame.script = &g_input_scene_script;
+  frame.callback = dali_input_scene_done;
+  g_input_scene_busy = dali_bus_enqueue(&frame, 0);
+}
+
+void dali_set_poll_budget(uint8_t percent)
+{
+  g_poll_budget_percent = (uint8_t)max(min(percent, 100), 1);
+}
+
+static void dali_poll_done(const dali_frame_t* frame, void* user_data)
+{
+  const dali_script_t* script = frame->script;
+  const dali_op_t* query = &script->ops[script->op_count - 1];
+  if (script->query_count > 0)
+  {
+    switch (script->status[0])
+    {
+      case DALI_FRAME_ANSWER:
       {
-#if !defined(LSX_RELEASE)
-        printf("SYMBOLS: %u\n", rx_data.num_symbols);
-        for (uint32_t i = 0; i < rx_data.num_symbols; ++i)
-        {
-          printf("Level 0: %u\n", rx_data.received_symbols[i].level0);
-          printf("Duration 0: %u\n", rx_data.received_symbols[i].duration0);
-          printf("Level 1: %u\n", rx_data.received_symbols[i].level1);
-          printf("Duration 1: %u\n", rx_data.received_symbols[i].duration1);
-        }
-#endif
+        dali_gear_answered(query->address, query->command, script->response[0]);
+        break;
       }
-      if (any_symbols)
+      case DALI_FRAME_NO_ANSWER:
       {
-        (*any_symbols) = (result || (rx_data.num_symbols >= 4));
+        dali_gear_missed(query->address, query->command);
+        break;
       }
+      default: break;
     }
   }
 
-  if (response_out) (*response_out) = response;
+  // The script's duration includes waiting for the bus to settle, so this
+  // errs on the side of leaving the bus alone. Stay idle long enough that
+  // the poll was only the budgeted share of the time since the last one.
+  uint32_t budget = g_poll_budget_percent;
+  uint32_t idle_us = (script->duration_us / budget) * (100 - budget);
+  lsx_timer_start(g_poll_timer, max(idle_us, 1), false);
+}
 
-  return result;
+// One query at a time, at the lowest priority, keeps the gear model in line
+// with what the gear report and tracks their health. The bus task takes
+// queued control frames first, so they wait at most for one poll. Runs from
+// the poll timer.
+static void dali_poll_gear(void* arguments)
+{
+  uint8_t address = 0;
+  uint8_t command = 0;
+  if (!dali_gear_next_query(&address, &command))
+  {
+    lsx_timer_start(g_poll_timer, DALI_POLL_RETRY_MS * 1000ULL, false);
+    return;
+  }
+
+  uint32_t count = 0;
+  if (command >= DALI_EX_FIRST)
+  {
+    g_poll_ops[count++] =
+      (dali_op_t)dali_op_frame(DALI_ENABLE_DEVICE_TYPE, DALI_DEVICE_TYPE_LED);
+  }
+  g_poll_ops[count++] = (dali_op_t)dali_op_query(address, command);
+  g_poll_script.ops = g_poll_ops;
+  g_poll_script.op_count = count;
+
+  dali_frame_t frame = {};
+  frame.script = &g_poll_script;
+  frame.priority = DALI_PRIORITY_PERIODIC;
+  frame.bus_class = DALI_CLASS_POLLING;
+  frame.callback = dali_poll_done;
+  if (!dali_bus_enqueue(&frame, 0))
+  {
+    lsx_timer_start(g_poll_timer, DALI_POLL_RETRY_MS * 1000ULL, false);
+  }
+}
+
+// Runs on the bus task, so it must not wait for the bus. An event arriving
+// while the last scene is still queued replaces whatever comes next.
+static void dali_input_event(uint32_t data, uint8_t bits, void* user_data)
+{
+  if ((bits != 24) || ((data & DALI_EVENT_SCHEME_MASK) != DALI_EVENT_SCHEME))
+  {
+    return;
+  }
+  uint8_t instance = (data >> 10) & 0x1F;
+  uint16_t event = data & 0x3FF;
+  if (instance >= array_size(dali.remote_inputs))
+  {
+    return;
+  }
+
+  switch (event)
+  {
+    case DALI_EVENT_BUTTON_PRESSED:
+    {
+      dali.remote_inputs[instance] = true;
+      break;
+    }
+    case DALI_EVENT_BUTTON_RELEASED:
+    {
+      dali.remote_inputs[instance] = false;
+      break;
+    }
+    case DALI_EVENT_BUTTON_SHORT_PRESS:
+    {
+      dali.remote_inputs[instance] = !dali.remote_inputs[instance];
+      break;
+    }
+    default: return;
+  }
+
+  bool inputs[3] = {};
+  for (uint32_t i = 0; i < array_size(inputs); ++i)
+  {
+    inputs[i] = dali.local_inputs[i] || dali.remote_inputs[i];
+  }
+  uint8_t index = get_input_index(inputs);
+  g_input_event_us = lsx_get_micro();
+
+  if (g_input_scene_busy)
+  {
+    g_input_scene_next = index;
+    return;
+  }
+  dali_queue_input_scene(index);
+}
+
+void dali_transmit(uint8_t address, uint8_t command)
+{
+  dali_bus_send(address, command);
+  dali_frame_sent(address, command);
+}
+
+void dali_transmit_twice(uint8_t address, uint8_t command)
+{
+  dali_bus_send_twice(address, command);
+  dali_frame_sent(address, command);
 }
 
 void led_set(uint8_t led_number, uint8_t r, uint8_t g, uint8_t b)
@@ -285,68 +745,99 @@ bool dali_set_config(dali_config_t config)
   return false;
 }
 
-static volatile uint32_t pin_change_count = 0;
-static volatile uint8_t pin_change_buffer[128] = {};
-static volatile uint32_t interupt_timemark = 0;
+void light_control_add_interrupt(void)
+{
+  dali_bus_set_edge_interrupt(true);
+}
 
-void pin_change(void* arguments)
+void light_control_remove_interrupt(void)
 {
-  uint32_t now_time = lsx_get_micro();
-  uint32_t difference = now_time - interupt_timemark;
-  if (difference >= (dali.delay + 100))
-  {
-    interupt_timemark = now_time;
-    if (difference < ((dali.delay + dali.delay) + 200))
-    {
-      pin_change_count *= (pin_change_count < sizeof(pin_change_buffer));
-      uint32_t index = pin_change_count;
-      pin_change_count = index + 1;
-      pin_change_buffer[index] = lsx_gpio_read(dali.rx_pin);
-    }
-    else
-    {
-      pin_change_count = 0;
-      interupt_timemark -= 200;
-    }
-  }
+  dali_bus_set_edge_interrupt(false);
 }
 
-void light_control_add_interrupt(void)
+static inline void dali_broadcast_twice(uint8_t command)
 {
-  lsx_gpio_add_pin_interrput(dali.rx_pin, pin_change, NULL);
+  dali_transmit_twice(DALI_BROADCAST, command);
 }
 
-void light_control_remove_interrupt(void)
+// YES/NO queries treat silence as the answer NO. The extended queries are
+// the IEC 62386-207 (LED) ones, the only device type driven here.
+static bool dali_query_is_yes_no(uint8_t address, uint8_t command)
 {
-  lsx_gpio_remove_pin_interrput(dali.rx_pin);
+  if ((address >= DALI_SPECIAL_FIRST) && (address <= DALI_SPECIAL_LAST))
+  {
+    return (address == DALI_COMPARE) || (address == DALI_VERIFY_SHORT_ADDRESS);
+  }
+  if ((address & 0x01) == 0)
+  {
+    return false;
+  }
+  switch (command)
+  {
+    case DALI_QUERY_CONTROL_GEAR_PRESENT:
+    case DALI_QUERY_LAMP_FAILURE:
+    case DALI_QUERY_LAMP_POWER_ON:
+    case DALI_QUERY_LIMIT_ERROR:
+    case DALI_QUERY_RESET_STATE:
+    case DALI_QUERY_MISSING_SHORT_ADDRESS:
+    case DALI_QUERY_POWER_FAILURE:
+    case DALI_EX_QUERY_SHORT_CIRCUIT:
+    case DALI_EX_QUERY_OPEN_CIRCUIT:
+    case DALI_EX_QUERY_LOAD_DECREASE:
+    case DALI_EX_QUERY_LOAD_INCREASE:
+    case DALI_EX_QUERY_CURRENT_PROTECTOR_ACTIVE:
+    case DALI_EX_QUERY_THERMAL_SHUT_DOWN:
+    case DALI_EX_QUERY_THERMAL_OVERLOAD:
+    case DALI_EX_QUERY_REFERENCE_RUNNING:
+    case DALI_EX_QUERY_REFERENCE_MEASUREMENT_FAILED:
+    case DALI_EX_QUERY_CURRENT_PROTECTOR_ENABLED:
+    {
+      return true;
+    }
+    default: break;
+  }
+  return false;
 }
 
-static inline void dali_broadcast_twice(uint8_t command)
+// Value queries sent to the special command address range, i.e. QUERY SHORT
+// ADDRESS while commissioning.
+static dali_query_class_t dali_query_class(uint8_t address, uint8_t command)
 {
-  lsx_delay_millis(delay_time);
-  dali_transmit(DALI_BROADCAST, command);
-  lsx_delay_millis(delay_time);
-  dali_transmit(DALI_BROADCAST, command);
-  lsx_delay_millis(delay_time);
+  if (dali_query_is_yes_no(address, command))
+  {
+    return DALI_QUERY_CLASS_YES_NO;
+  }
+  if ((address >= DALI_SPECIAL_FIRST) && (address <= DALI_SPECIAL_LAST))
+  {
+    return DALI_QUERY_CLASS_ADDRESS;
+  }
+  return DALI_QUERY_CLASS_VALUE;
 }
 
 uint8_t dali_query_(uint8_t address, uint8_t command, bool* error_out,
                     bool* any_response)
 {
-  lsx_delay_millis(delay_time);
-
   uint8_t result = 0;
+  dali_frame_status_t status = dali_bus_query(address, command, &result);
 
-  rmt_enable(g_rmt_tx_channel);
-  rmt_enable(g_rmt_rx_channel);
-
-  dali_transmit_(address, command);
-  bool success = dali_read_response(50, &result, any_response);
-
-  rmt_disable(g_rmt_rx_channel);
-  rmt_disable(g_rmt_tx_channel);
+  if (dali_query_is_yes_no(address, command))
+  {
+    // Several gear answering YES at once collide, which is still a YES. Only
+    // a forward frame that never made it onto the bus leaves it open.
+    bool answered = (status == DALI_FRAME_ANSWER) || (status == DALI_FRAME_INVALID);
+    if (error_out)
+    {
+      (*error_out) = !answered && (status != DALI_FRAME_NO_ANSWER);
+    }
+    if (any_response) (*any_response) = answered;
+    return answered ? DALI_YES : DALI_NO;
+  }
 
-  if (error_out) (*error_out) = !success;
+  if (error_out) (*error_out) = (status != DALI_FRAME_ANSWER);
+  if (any_response)
+  {
+    (*any_response) = (status == DALI_FRAME_ANSWER) || (status == DALI_FRAME_INVALID);
+  }
   return result;
 }
 
@@ -360,7 +851,7 @@ uint8_t dali_query1(uint8_t address, uint8_t command, bool* error)
     while ((*error) && (tries++ < total_number_of_tries))
     {
       *error = false;
-      lsx_delay_millis(delay_time * 2);
+      vTaskDelay(pdMS_TO_TICKS(delay_time * 2));
       response = dali_query_(address, command, error, NULL);
     }
   }
@@ -369,57 +860,80 @@ uint8_t dali_query1(uint8_t address, uint8_t command, bool* error)
 
 uint8_t dali_query0(uint8_t address, uint8_t command, bool* error)
 {
+  uint8_t cached = 0;
+  if (dali_query_cache_get(address, command, &cached))
+  {
+    if (error) *error = false;
+    return cached;
+  }
+
   led_set(LED_DALI, 0, 0, 127);
   vTaskDelay(pdMS_TO_TICKS(32));
 
-  uint32_t total_number_queries = 4;
+  // Only a disagreement or a frame that did not decode costs another sample,
+  // the bus task already keeps the settling time between them.
+  const dali_vote_policy_t* policy = &g_vote_policy[dali_query_class(address, command)];
+  uint8_t responses[DALI_VOTE_MAX_SAMPLES] = {};
   uint32_t count = 0;
-  uint8_t responses[4] = {};
-
-  if (error) *error = true;
+  uint32_t samples = 0;
+  bool accepted = false;
+  uint8_t response = 0;
 
-  for (uint32_t i = 0; i < total_number_queries; ++i)
+  while (!accepted && (samples < policy->max_samples))
   {
     bool error_temp = false;
-    uint8_t temp_response = dali_query1(address, command, &error_temp);
-    if (!error_temp)
+    uint8_t temp_response = dali_query_(address, command, &error_temp, NULL);
+    samples++;
+    if (error_temp)
     {
-      responses[count++] = temp_response;
+      continue;
     }
-    vTaskDelay(pdMS_TO_TICKS(16));
-  }
-  if (count >= 3)
-  {
-    uint32_t correct_count = 0;
-    uint8_t current_response = 0;
+
+    uint32_t matches = 1;
     for (uint32_t i = 0; i < count; ++i)
     {
-      correct_count = 0;
-      current_response = responses[i];
-      for (uint32_t j = 0; j < count; ++j)
-      {
-        if ((current_response == responses[j]) && ((++correct_count) >= 3))
-        {
-          if (error) *error = false;
-          lsx_log("Query: %u\n", current_response);
+      matches += (responses[i] == temp_response);
+    }
+    responses[count++] = temp_response;
+    if (matches >= policy->agree)
+    {
+      accepted = true;
+      response = temp_response;
+    }
+  }
 
-          led_set(LED_DALI, 0, 127, 0);
-          vTaskDelay(pdMS_TO_TICKS(32));
+  dali_query_lock();
+  g_query_stats.queries++;
+  g_query_stats.samples += samples;
+  if (accepted && (samples == policy->agree))
+  {
+    g_query_stats.agreed++;
+  }
+  else if (!accepted)
+  {
+    g_query_stats.failed++;
+  }
+  dali_query_unlock();
 
-          return current_response;
-        }
-      }
-    }
+  if (error) *error = !accepted;
+  if (accepted)
+  {
+    lsx_log("Query: %u\n", response);
+    dali_query_cache_put(address, command, response);
+    dali_gear_answered(address, command, response);
   }
+
   led_set(LED_DALI, 0, 127, 0);
   vTaskDelay(pdMS_TO_TICKS(32));
-  return 0;
+  return response;
 }
 
 uint8_t dali_query(uint8_t command, bool* error_out)
 {
   uint8_t result = 0;
-  if (dali.short_address_count == 0)
+  dali_table_t table = {};
+  dali_table_get(&table);
+  if (table.count == 0)
   {
     result = dali_query0(DALI_BROADCAST, command, error_out);
   }
@@ -427,11 +941,11 @@ uint8_t dali_query(uint8_t command, bool* error_out)
   {
     bool success = false;
     uint8_t max = 0;
-    for (uint32_t i = 0; i < dali.short_address_count; ++i)
+    for (uint32_t i = 0; i < table.count; ++i)
     {
       bool error = false;
       uint8_t current =
-        dali_query0((dali.short_address[i] << 1) | 0x01, command, &error);
+        dali_query0((table.short_address[i] << 1) | 0x01, command, &error);
       if (!error && (current >= max))
       {
         max = current;
@@ -455,9 +969,8 @@ uint8_t dali_query(uint8_t command, bool* error_out)
 uint8_t dali_scale(uint8_t procent, uint8_t* min_brightness_out)
 {
 #if 1
-  bool error = false;
-  uint8_t response = dali_query(DALI_QUERY_MIN_LEVEL, &error);
-  uint8_t min_brightness = error ? 1 : response;
+  // From the gear model, read in the background rather than on every change.
+  uint8_t min_brightness = max(dali_gear_min_level(1), 1);
   lsx_log("Min: %u\n", min_brightness);
 #else
   uint8_t min_brightness = 1;
@@ -484,11 +997,7 @@ void dali_set_brightness_(uint8_t brightness)
   vTaskDelay(pdMS_TO_TICKS(32));
 
 #if 1
-  lsx_delay_millis(delay_time);
-  dali_transmit(DALI_BROADCAST_DP, brightness);
-  lsx_delay_millis(delay_time);
-  dali_transmit(DALI_BROADCAST_DP, brightness);
-  lsx_delay_millis(delay_time);
+  dali_transmit_twice(DALI_BROADCAST_DP, brightness);
 #else
   lsx_delay_millis(delay_time);
   dali_transmit(DALI_BROADCAST_DP, brightness);
@@ -508,9 +1017,8 @@ void dali_send_brightness(uint8_t brightness)
   brightness = dali_scale(brightness, &min_brightness) * (brightness != 0);
 
 #if 1
-  lsx_delay_millis(delay_time);
-  bool error = false;
-  uint8_t level = dali_query(DALI_QUERY_ACTUAL_OUTPUT, &error);
+  uint8_t level = 0;
+  bool error = !dali_gear_level(&level);
   lsx_log("Error: %u\n", error);
 #else
   bool error = true;
@@ -584,37 +1092,6 @@ void dali_transmit(uint8_t address, uint8_t command)
 }
 #endif
 
-uint8_t dali_receive_(bool* error, uint32_t delay)
-{
-  interupt_timemark = lsx_get_micro();
-  pin_change_count = 0;
-
-  if (error) *error = true;
-
-  uint32_t start = lsx_get_micro();
-  while (pin_change_count < 9)
-  {
-    if ((lsx_get_micro() - start) >= delay)
-    {
-      return 0;
-    }
-  }
-  if (error) *error = false;
-
-  uint8_t response = 0;
-  for (uint32_t i = 1; i < 9; ++i)
-  {
-    response |= (!(pin_change_buffer[i])) << (8 - i);
-  }
-
-  return response;
-}
-
-uint8_t dali_receive(bool* error)
-{
-  return dali_receive_(error, 40000);
-}
-
 void dali_set_DTR0(uint8_t value)
 {
   dali_transmit(0xA3, value);
@@ -623,30 +1100,39 @@ void dali_set_DTR0(uint8_t value)
 void dali_select_dimming_curve_(uint8_t curve)
 {
   dali_set_DTR0(curve);
-  lsx_delay_millis(delay_time);
   dali_transmit(0xC1, 6);
-  lsx_delay_millis(delay_time);
   dali_broadcast_twice(DALI_EX_SELECT_DIMMING_CURVE);
 }
 
+static void dali_run_script(const char* name, const dali_op_t* ops, uint32_t op_count)
+{
+  dali_script_t script = {};
+  script.ops = ops;
+  script.op_count = op_count;
+  dali_frame_status_t status = dali_bus_run_script(&script);
+  dali_script_sent(&script, (status == DALI_FRAME_SENT) && (script.failed == 0));
+  lsx_log("%s: %lu ops, %lu transmissions, %lu ms\n", name, op_count,
+          script.transmissions, script.duration_us / 1000);
+}
+
 static void dali_set_saved_configuration(void)
 {
   led_set(LED_DALI, 0, 0, 127);
   vTaskDelay(pdMS_TO_TICKS(40));
 
   dali.fade_time = dali.config.fade_time;
-
-  lsx_delay_millis(delay_time);
-  dali_set_DTR0(dali.fade_time);
-  lsx_delay_millis(delay_time);
-  dali_broadcast_twice(DALI_SET_FADE_TIME);
-  lsx_delay_millis(delay_time);
-
   dali.dimming_curve = DALI_DIMMING_LOGARITHMIC;
-  dali_set_DTR0(dali.dimming_curve);
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xC1, 6);
-  dali_broadcast_twice(DALI_EX_SELECT_DIMMING_CURVE);
+
+  const dali_op_t ops[] = {
+    dali_op_frame(0xA3, dali.fade_time),
+    dali_op_twice(DALI_BROADCAST, DALI_SET_FADE_TIME),
+    dali_op_frame(0xA3, dali.dimming_curve),
+    dali_op_frame(0xC1, 6),
+    dali_op_twice(DALI_BROADCAST, DALI_EX_SELECT_DIMMING_CURVE),
+  };
+  dali_bus_set_class(DALI_CLASS_CONFIGURATION);
+  dali_run_script("Configuration", ops, array_size(ops));
+  dali_bus_set_class(DALI_CLASS_CONTROL);
 
   led_set(LED_DALI, 0, 127, 0);
   vTaskDelay(pdMS_TO_TICKS(40));
@@ -661,77 +1147,81 @@ void dali_short_scan(void)
     if (any_response)
     {
       lsx_log("Found Short address: %u\n", i);
-      dali.short_address[dali.short_address_count++] = i;
+      dali_table_add(i, 0);
+      dali_gear_set_present(i);
       break;
     }
   }
 }
 
-void dali_scan(void)
+static bool dali_search_send(uint8_t address, uint8_t command, void* context)
+{
+  dali_frame_status_t status = dali_bus_send(address, command);
+  dali_frame_sent(address, command);
+  return status == DALI_FRAME_SENT;
+}
+
+static bool dali_search_compare(void* context)
 {
-  int32_t low_address = 0;
-  int32_t high_address = 0x00FFFFFF;
-  int32_t current_address = (int32_t)(low_address + high_address) / 2;
+  bool any_response = false;
+  dali_query_(DALI_COMPARE, 0, NULL, &any_response);
+  return any_response;
+}
+
+static void dali_commission_found(const dali_search_t* search);
 
-  int32_t last_address = high_address;
+// Times a gear already in the table may be found again, and sent WITHDRAW
+// again, before the search gives up on it.
+#define DALI_SCAN_WITHDRAW_RETRIES 3
+
+// Runs the search from wherever it stands, so an interrupted one can carry on.
+void dali_scan(dali_search_t* search)
+{
+  uint32_t current_address = 0;
   uint8_t short_address = 0;
+  uint32_t repeat_address = 0;
+  uint32_t repeats = 0;
 
-  uint32_t count = 0;
   bool still_scanning = true;
+
+  dali_bus_begin();
   while (still_scanning &&
          (dali.short_address_count < array_size(dali.short_address)))
   {
     esp_task_wdt_reset();
 
-    while ((high_address - low_address) > 0)
+    if (dali_search_lowest(search, &current_address))
     {
-      // lsx_log("Low: %ld\n", low_address);
-      // lsx_log("High: %ld\n", high_address);
-      bool any_response = false;
-      for (uint32_t i = 0; i < 1; ++i)
-      {
-        lsx_delay_millis(delay_time);
-        dali_transmit(0xB1, (current_address >> 16) & 0xFF);
-        lsx_delay_millis(delay_time);
-        dali_transmit(0xB3, (current_address >> 8) & 0xFF);
-        lsx_delay_millis(delay_time);
-        dali_transmit(0xB5, current_address & 0xFF);
-
-        lsx_delay_millis(delay_time);
+      bool error = true;
+      uint8_t temp_short_address = dali_query0(0xBB, 0, &error) >> 1;
 
-        dali_query_(0xA9, 0, NULL, &any_response);
-        if (any_response)
-        {
-          break;
-        }
-      }
+      printf("Found short address: %u\n", temp_short_address);
 
-      if (any_response)
+      // A gear that missed its WITHDRAW is found again by the search. It has
+      // its address already, so it only gets the WITHDRAW again.
+      bool known = false;
+      for (uint32_t i = 0; i < dali.short_address_count; ++i)
       {
-        high_address = current_address;
+        known = known || ((dali.short_address[i] == temp_short_address) &&
+                          (dali.random_address[i] == current_address));
       }
-      else
+      if (known)
       {
-        low_address = current_address + 1;
+        // One that never acts on it answers every COMPARE from here on, so
+        // the search cannot get past it.
+        repeats = (current_address == repeat_address) ? (repeats + 1) : 1;
+        repeat_address = current_address;
+        if (repeats > DALI_SCAN_WITHDRAW_RETRIES)
+        {
+          lsx_log("Commissioning: gear %u ignores WITHDRAW, search stopped\n",
+                  temp_short_address);
+          still_scanning = false;
+          break;
+        }
+        dali_transmit(DALI_WITHDRAW, 0);
+        continue;
       }
 
-      current_address = (int32_t)(low_address + high_address) / 2;
-    }
-
-    if (high_address != 0x00FFFFFF)
-    {
-      lsx_delay_millis(delay_time);
-      dali_transmit(0xB1, (current_address >> 16) & 0xFF);
-      lsx_delay_millis(delay_time);
-      dali_transmit(0xB3, (current_address >> 8) & 0xFF);
-      lsx_delay_millis(delay_time);
-      dali_transmit(0xB5, current_address & 0xFF);
-
-      bool error = true;
-      uint8_t temp_short_address = dali_query0(0xBB, 0, &error) >> 1;
-
-      printf("Found short address: %u\n", temp_short_address);
-
       bool found = true;
       if (temp_short_address < array_size(dali.short_address))
       {
@@ -769,23 +1259,18 @@ void dali_scan(void)
         break;
       }
 
-      lsx_delay_millis(delay_time);
       dali_transmit(0xB7, (short_address << 1) | 0x01);
-      lsx_delay_millis(delay_time);
 
       temp_short_address = dali_query0(0xBB, 0, &error) >> 1;
       printf("Short address after set: %u\n", temp_short_address);
 
       dali_transmit(0xAB, 0);
-      lsx_delay_millis(delay_time);
-
-      dali.short_address[dali.short_address_count++] = short_address;
 
-      lsx_log("Found address: %ld\n", current_address);
+      dali_table_add(short_address, current_address);
+      dali_gear_set_present(short_address);
+      dali_commission_found(search);
 
-      low_address = 0;
-      high_address = 0x00FFFFFF;
-      current_address = (low_address + high_address) / 2;
+      lsx_log("Found address: %lu\n", current_address);
 
       short_address++;
     }
@@ -795,13 +1280,428 @@ void dali_scan(void)
     }
   }
 
-  lsx_delay_millis(delay_time);
   dali_transmit(0xA1, 0);
-  lsx_delay_millis(delay_time);
+  dali_bus_end();
 
   vTaskDelay(pdMS_TO_TICKS(600));
 
   lsx_log("Short address count: %lu\n", dali.short_address_count);
+  lsx_log("Search: %lu compares, %lu address frames, %lu skipped\n", search->compares,
+          search->address_frames, search->skipped_frames);
+}
+
+#if DALI_BENCHMARK
+// Gear that answer COMPARE while their random address is at or below the
+// search address they received, until withdrawn.
+typedef struct dali_simulated_bus_t
+{
+  uint32_t random_address[DALI_GEAR_COUNT];
+  bool withdrawn[DALI_GEAR_COUNT];
+  uint32_t count;
+  uint32_t search_address;
+} dali_simulated_bus_t;
+
+static bool dali_simulated_send(uint8_t address, uint8_t command, void* context)
+{
+  dali_simulated_bus_t* bus = (dali_simulated_bus_t*)context;
+  uint32_t shift = (address == DALI_SEARCHADDRH) ? 16 : ((address == DALI_SEARCHADDRM) ? 8 : 0);
+  bus->search_address = (bus->search_address & ~(0xFFUL << shift)) | (command << shift);
+  return true;
+}
+
+static bool dali_simulated_compare(void* context)
+{
+  const dali_simulated_bus_t* bus = (const dali_simulated_bus_t*)context;
+  for (uint32_t i = 0; i < bus->count; ++i)
+  {
+    if (!bus->withdrawn[i] && (bus->random_address[i] <= bus->search_address))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void dali_benchmark_search(void)
+{
+  static const uint32_t populations[] = { 1, 4, 16, 64 };
+  for (uint32_t p = 0; p < array_size(populations); ++p)
+  {
+    dali_simulated_bus_t bus = {};
+    bus.count = populations[p];
+    bus.search_address = DALI_SEARCH_ADDRESS_MAX;
+    for (uint32_t i = 0; i < bus.count; ++i)
+    {
+      bus.random_address[i] = esp_random() % DALI_SEARCH_ADDRESS_MAX;
+    }
+
+    dali_search_t search = {};
+    dali_search_begin(&search, dali_simulated_send, dali_simulated_compare, &bus);
+    uint32_t found = 0;
+    uint32_t address = 0;
+    while (dali_search_lowest(&search, &address))
+    {
+      // WITHDRAW, taking any gear with the same random address along.
+      uint32_t withdrawn = found;
+      for (uint32_t i = 0; i < bus.count; ++i)
+      {
+        if (!bus.withdrawn[i] && (bus.random_address[i] == bus.search_address))
+        {
+          bus.withdrawn[i] = true;
+          found++;
+        }
+      }
+      if (found == withdrawn)
+      {
+        break;
+      }
+    }
+
+    // A fresh 24-step descent for every gear, and one more to find nothing
+    // is left. Sending every byte puts three frames before each compare and
+    // before programming. Both ways also send QUERY SHORT ADDRESS, PROGRAM
+    // SHORT ADDRESS, the check query and WITHDRAW for every gear found.
+    uint32_t descent_compares = (found + 1) * 24;
+    uint32_t frames = search.compares + search.address_frames + found * 4;
+    uint32_t every_byte_frames = descent_compares * 4 + found * (3 + 4);
+
+    // Telling which of the 2^24 choose n address sets is on the bus takes
+    // log2 of that many yes/no answers.
+    float minimum = 0.0f;
+    for (uint32_t i = 0; i < bus.count; ++i)
+    {
+      minimum += log2f((float)(DALI_SEARCH_ADDRESS_MAX + 1 - i) / (float)(i + 1));
+    }
+
+    lsx_log("Search %lu gear: %s, %lu compares, %lu fresh descents, %lu minimum\n",
+            bus.count, (found == bus.count) ? "all found" : "MISSED GEAR",
+            search.compares, descent_compares, (uint32_t)minimum);
+    lsx_log("Search %lu gear: %lu frames, %lu sending every byte each descent (%lu%%)\n",
+            bus.count, frames, every_byte_frames,
+            (frames * 100) / max(every_byte_frames, 1));
+  }
+}
+#endif
+
+#define DALI_COMMISSION_KEY     "Commission"
+#define DALI_COMMISSION_JOB_KEY "CommJob"
+
+// A commissioning run in progress, stored after every gear found so a run
+// cut short by a reset carries on where it stopped. Gear keep their random
+// address over a power cycle, and the search only moves upwards.
+typedef struct dali_commission_job_t
+{
+  uint8_t active;
+  uint8_t initialise; // INITIALISE operand the run was started with.
+  uint32_t low;       // Every gear below was found.
+  uint32_t found;     // Gear found so far.
+} dali_commission_job_t;
+
+static dali_commission_job_t g_commission_job = {};
+static volatile bool g_commission_resume = false;
+
+// One word per gear: the short address in the top byte, the random address
+// below it.
+static bool dali_commission_load(void)
+{
+  uint32_t table[array_size(dali.short_address)] = {};
+  uint32_t size = 0;
+  if (!lsx_nvs_get_bytes(dali.scene_nvs, DALI_COMMISSION_KEY, table, &size,
+                         sizeof(table)))
+  {
+    return false;
+  }
+
+  uint32_t count = 0;
+  uint8_t short_addresses[array_size(dali.short_address)] = {};
+  uint32_t random_addresses[array_size(dali.short_address)] = {};
+  for (uint32_t i = 0; i < (size / sizeof(table[0])); ++i)
+  {
+    uint8_t short_address = table[i] >> 24;
+    if (short_address < array_size(dali.short_address))
+    {
+      random_addresses[count] = table[i] & DALI_SEARCH_ADDRESS_MAX;
+      short_addresses[count++] = short_address;
+      dali_gear_set_present(short_address);
+    }
+  }
+
+  dali_table_lock();
+  memcpy(dali.short_address, short_addresses, sizeof(short_addresses));
+  memcpy(dali.random_address, random_addresses, sizeof(random_addresses));
+  dali.short_address_count = count;
+  dali_table_unlock();
+  lsx_log("Commissioning table: %lu gear\n", count);
+  return count > 0;
+}
+
+static void dali_commission_save(void)
+{
+  uint32_t table[array_size(dali.short_address)] = {};
+  for (uint32_t i = 0; i < dali.short_address_count; ++i)
+  {
+    table[i] = ((uint32_t)dali.short_address[i] << 24) | dali.random_address[i];
+  }
+  lsx_nvs_set_bytes_ram(dali.scene_nvs, DALI_COMMISSION_KEY, table,
+                        dali.short_address_count * sizeof(table[0]));
+  lsx_nvs_commit(dali.scene_nvs);
+}
+
+// Boot check of a stored table: QUERY CONTROL GEAR PRESENT to every gear in
+// it, then one broadcast QUERY MISSING SHORT ADDRESS for gear added since.
+// The queries are queued one at a time at commissioning class, so the first
+// light goes out ahead of them. Only touched on the bus task once started.
+static uint32_t g_verify_index = 0;
+
+// Stored gear that did not answer the boot check. They keep their short
+// address and are reported on /commission. Under g_table_lock.
+static uint32_t g_verify_missing = 0;
+
+static void dali_verify_next(void);
+
+static void dali_verify_done(const dali_frame_t* frame, void* user_data)
+{
+  uint8_t address = (frame->data >> 8) & 0xFF;
+  uint8_t command = frame->data & 0xFF;
+  // A garbled answer still means something answered.
+  bool answered = (frame->status == DALI_FRAME_ANSWER) ||
+                  (frame->status == DALI_FRAME_INVALID);
+  if (command == DALI_QUERY_MISSING_SHORT_ADDRESS)
+  {
+    lsx_log("Commissioning table: %s\n",
+            answered ? "gear without short address found" : "verified");
+    if (answered)
+    {
+      dali_commission_new_gear();
+    }
+    return;
+  }
+
+  if (!answered)
+  {
+    lsx_log("Commissioning table: gear %u missing\n", address >> 1);
+    dali_gear_missed(address, command);
+    dali_table_lock();
+    g_verify_missing++;
+    dali_table_unlock();
+  }
+  dali_verify_next();
+}
+
+static void dali_verify_next(void)
+{
+  uint8_t address = DALI_BROADCAST;
+  uint8_t command = DALI_QUERY_MISSING_SHORT_ADDRESS;
+  dali_table_lock();
+  if (g_verify_index < dali.short_address_count)
+  {
+    address = (dali.short_address[g_verify_index++] << 1) | 0x01;
+    command = DALI_QUERY_CONTROL_GEAR_PRESENT;
+  }
+  dali_table_unlock();
+
+  dali_frame_t frame = {};
+  frame.data = dali_frame_16(address, command);
+  frame.bits = 16;
+  frame.flags = DALI_FRAME_EXPECT_ANSWER;
+  frame.bus_class = DALI_CLASS_COMMISSIONING;
+  frame.callback = dali_verify_done;
+  if (!dali_bus_enqueue(&frame, 0))
+  {
+    lsx_log("Commissioning table: verification could not be queued\n");
+  }
+}
+
+static void dali_verify_begin(void)
+{
+  g_verify_index = 0;
+  dali_table_lock();
+  g_verify_missing = 0;
+  dali_table_unlock();
+  dali_verify_next();
+}
+
+static void dali_commission_save_job(void)
+{
+  if (g_commission_job.active)
+  {
+    lsx_nvs_set_bytes_ram(dali.scene_nvs, DALI_COMMISSION_JOB_KEY, &g_commission_job,
+                          sizeof(g_commission_job));
+  }
+  else
+  {
+    lsx_nvs_remove_key(dali.scene_nvs, DALI_COMMISSION_JOB_KEY);
+  }
+  lsx_nvs_commit(dali.scene_nvs);
+}
+
+static bool dali_commission_load_job(void)
+{
+  dali_commission_job_t job = {};
+  uint32_t size = 0;
+  if (!lsx_nvs_get_bytes(dali.scene_nvs, DALI_COMMISSION_JOB_KEY, &job, &size,
+                         sizeof(job)) ||
+      (size != sizeof(job)) || !job.active)
+  {
+    return false;
+  }
+  dali_table_lock();
+  g_commission_job = job;
+  dali_table_unlock();
+  return true;
+}
+
+// Called by dali_scan() for every gear found, after it is in the table.
+static void dali_commission_found(const dali_search_t* search)
+{
+  dali_table_lock();
+  g_commission_job.low = search->low;
+  g_commission_job.found = search->found;
+  dali_table_unlock();
+  dali_commission_save();
+  dali_commission_save_job();
+}
+
+// Sets the levels every gear is commissioned with.
+static void dali_set_levels(void)
+{
+  dali_bus_set_class(DALI_CLASS_CONFIGURATION);
+  dali.fade_rate = 1;
+  const dali_op_t level_ops[] = {
+    dali_op_frame(0xA3, 0),
+    dali_op_twice(DALI_BROADCAST, DALI_SET_MIN_LEVEL),
+    dali_op_frame(0xA3, 254),
+    dali_op_twice(DALI_BROADCAST, DALI_SET_MAX_LEVEL),
+    dali_op_frame(0xA3, dali.fade_rate),
+    dali_op_twice(DALI_BROADCAST, DALI_SET_FADE_RATE),
+  };
+  dali_run_script("Levels", level_ops, array_size(level_ops));
+  dali_bus_set_class(DALI_CLASS_CONTROL);
+}
+
+// Randomises and addresses the gear INITIALISE takes in, keeping the short
+// addresses already in the table, and stores the table. A resumed run skips
+// RANDOMISE, withdraws the gear it found before and searches on from there.
+static void dali_commission(uint8_t initialise, bool resume)
+{
+  dali_bus_set_class(DALI_CLASS_COMMISSIONING);
+  dali_search_t search = {};
+  dali_search_begin(&search, dali_search_send, dali_search_compare, NULL);
+
+  const dali_op_t initialise_ops[] = {
+    dali_op_frame(DALI_TERMINATE, 0),
+    dali_op_wait(600),
+    dali_op_twice(DALI_INITIALISE, initialise),
+    dali_op_twice(DALI_RANDOMISE, 0),
+  };
+  if (resume)
+  {
+    dali_run_script("Resume", initialise_ops, array_size(initialise_ops) - 1);
+    search.low = g_commission_job.low;
+    search.found = g_commission_job.found;
+    for (uint32_t i = 0; i < dali.short_address_count; ++i)
+    {
+      if (dali.random_address[i] < search.low)
+      {
+        dali_search_set_address(&search, dali.random_address[i]);
+        dali_transmit(DALI_WITHDRAW, 0);
+      }
+    }
+  }
+  else
+  {
+    dali_run_script("Initialise", initialise_ops, array_size(initialise_ops));
+  }
+
+  dali_table_lock();
+  g_commission_job.active = true;
+  g_commission_job.initialise = initialise;
+  g_commission_job.low = search.low;
+  g_commission_job.found = search.found;
+  dali_table_unlock();
+  dali_commission_save_job();
+
+  dali_scan(&search);
+  dali_bus_set_class(DALI_CLASS_CONTROL);
+
+  dali_table_lock();
+  g_commission_job.active = false;
+  dali_table_unlock();
+  dali_commission_save();
+  dali_commission_save_job();
+}
+
+// Commissioning runs on its own task, so the DALI task keeps controlling the
+// lights meanwhile. Its frames are queued at commissioning class and step
+// aside for control traffic at every frame boundary.
+static void dali_commission_task(void* parameters)
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    esp_task_wdt_add(NULL);
+
+    uint32_t start = lsx_get_millis();
+    uint32_t count = dali.short_address_count;
+    dali_commission(g_commission_job.initialise, g_commission_resume);
+    if ((dali.short_address_count > count) || g_commission_resume)
+    {
+      dali_set_levels();
+      dali_set_saved_configuration();
+    }
+    lsx_log("Commissioning: %lu new gear in %lu ms\n", dali.short_address_count - count,
+            lsx_get_millis() - start);
+
+    esp_task_wdt_delete(NULL);
+    g_commissioning = false;
+  }
+}
+
+static bool dali_commission_start(uint8_t initialise, bool resume)
+{
+  // The web server and the bus task may both ask at once.
+  if (!g_commission_task || __atomic_exchange_n(&g_commissioning, true, __ATOMIC_ACQ_REL))
+  {
+    return false;
+  }
+  dali_table_lock();
+  g_commission_job.initialise = initialise;
+  dali_table_unlock();
+  g_commission_resume = resume;
+  xTaskNotifyGive(g_commission_task);
+  return true;
+}
+
+bool dali_commission_new_gear(void)
+{
+  return dali_commission_start(DALI_INITIALISE_UNADDRESSED, false);
+}
+
+void dali_get_commission_progress(dali_commission_progress_t* progress_out)
+{
+  dali_table_lock();
+  progress_out->running = g_commissioning;
+  progress_out->all_gear = g_commission_job.initialise == DALI_INITIALISE_ALL;
+  progress_out->found = g_commission_job.found;
+  progress_out->gear_count = dali.short_address_count;
+  progress_out->missing = g_verify_missing;
+  // The search runs up through the random address space.
+  progress_out->percent =
+    g_commissioning ? (uint8_t)(((uint64_t)g_commission_job.low * 100) >> 24) : 100;
+  dali_table_unlock();
+}
+
+// While a run that takes in all gear is going, most gear may have no short
+// address yet, so lights are driven by broadcast and the gear found so far
+// are addressed on top of it.
+static bool dali_broadcast_control(void)
+{
+  dali_table_lock();
+  bool broadcast =
+    (dali.short_address_count == 0) ||
+    (g_commissioning && (g_commission_job.initialise == DALI_INITIALISE_ALL));
+  dali_table_unlock();
+  return broadcast;
 }
 
 typedef struct dali_send_t
@@ -825,66 +1725,54 @@ void dali_initialize_(void)
 
   dali.tx_pin = DALI_TX;
   dali.rx_pin = DALI_RX;
-  dali.delay = 833 / 2;
+  dali.delay = DALI_BUS_HALF_BIT_US;
   dali.on_the_same_level_count = 0;
   dali.current_brightness = 0;
 
-  dali_initialize_rmt();
-
-  vTaskDelay(pdMS_TO_TICKS(600));
-
-#if 0
-  lsx_gpio_install_interrupt_service();
-  lsx_gpio_add_pin_interrput(dali.rx_pin, pin_change, NULL);
-#endif
+  dali_gear_initialize();
+  dali_bus_initialize(dali.delay);
+  g_commission_task = xTaskCreateStatic(
+    dali_commission_task, "DALI Commission", DALI_COMMISSION_STACK_SIZE, NULL, 2,
+    dali_commission_stack, &dali_commission_stack_type);
+  dali_bus_set_event_callback(dali_input_event, NULL);
 
 #if 1
 
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xA1, 0);
-  lsx_delay_millis(delay_time);
-
-  vTaskDelay(pdMS_TO_TICKS(600));
+  dali_bus_begin();
 
   // dali_short_scan();
 
 #if 1
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xA5, 0);
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xA5, 0);
-  lsx_delay_millis(delay_time);
-
-#if 1
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xA7, 0);
-  lsx_delay_millis(delay_time);
-  dali_transmit(0xA7, 0);
-  lsx_delay_millis(delay_time);
-#endif
-
-  dali_scan();
-
-#endif
-
-  lsx_delay_millis(delay_time);
-  dali_set_DTR0(0);
-  lsx_delay_millis(delay_time);
-  dali_broadcast_twice(DALI_SET_MIN_LEVEL);
-  lsx_delay_millis(delay_time);
-
-  lsx_delay_millis(delay_time);
-  dali_set_DTR0(254);
-  lsx_delay_millis(delay_time);
-  dali_broadcast_twice(DALI_SET_MAX_LEVEL);
-  lsx_delay_millis(delay_time);
-
+  // A known installation keeps its addresses: no INITIALISE or RANDOMISE,
+  // and the levels and configuration are already in the gear. The stored
+  // table is checked in the background and only gear added since get
+  // commissioned.
+  // A run cut short by a reset carries on in the background, and so does the
+  // first commissioning of a new installation. Either way the control loop
+  // starts right away.
   dali.fade_rate = 1;
-  dali_set_DTR0(dali.fade_rate);
-  lsx_delay_millis(delay_time);
-  dali_broadcast_twice(DALI_SET_FADE_RATE);
+  dali.fade_time = dali.config.fade_time;
+  dali.dimming_curve = DALI_DIMMING_LOGARITHMIC;
+  bool stored = dali_commission_load();
+  if (dali_commission_load_job())
+  {
+    lsx_log("Commissioning: resuming after %lu gear\n", g_commission_job.found);
+    dali_commission_start(g_commission_job.initialise, true);
+  }
+  else if (stored)
+  {
+    dali_verify_begin();
+  }
+  else
+  {
+    dali_commission_start(DALI_INITIALISE_ALL, false);
+  }
+#endif
 
-  dali_set_saved_configuration();
+  dali_bus_end();
+  g_poll_timer = lsx_timer_create(dali_poll_gear, NULL);
+  lsx_timer_start(g_poll_timer, DALI_POLL_RETRY_MS * 1000ULL, false);
+  lsx_log("Dali ready after %lu ms\n", lsx_get_millis());
 
 #if 0
   srand(lsx_get_micro());
@@ -911,13 +1799,48 @@ void dali_transmit(uint8_t address, uint8_t command)
 }
 #endif
 
+// The gear whose short address matches the input index goes on, the rest
+// off. gap_ms spaces the gear apart.
+static void dali_send_input_levels(bool* inputs, uint32_t gap_ms)
+{
+  uint8_t index = get_input_index(inputs);
+  if (dali_broadcast_control())
+  {
+    dali_transmit_twice(DALI_BROADCAST_DP, (index != 0) ? 254 : 0);
+  }
+  dali_table_t table = {};
+  dali_table_get(&table);
+  for (uint32_t i = 0; i < table.count; ++i)
+  {
+    dali_transmit_twice(table.short_address[i] << 1,
+                        (index == table.short_address[i]) ? 254 : 0);
+    if (gap_ms > 0)
+    {
+      vTaskDelay(pdMS_TO_TICKS(gap_ms));
+    }
+  }
+}
+
 void dali_task(void* pvParameters)
 {
   esp_task_wdt_add(NULL);
 
+#if DALI_BENCHMARK
+  dali_benchmark_search();
+#endif
+
   dali_initialize_();
 
-  vTaskDelay(pdMS_TO_TICKS(100));
+  // The first light goes out from the stored table and a single read of the
+  // inputs, without waiting the 600 ms the input filter takes to fill.
+  bool first_inputs[3] = {};
+  for (uint32_t i = 0; i < array_size(first_inputs); ++i)
+  {
+    first_inputs[i] =
+      (lsx_gpio_read(dali_input_pins[i]) == LSX_GPIO_LOW) || dali.remote_inputs[i];
+  }
+  dali_send_input_levels(first_inputs, 0);
+  lsx_log("Dali first light after %lu ms\n", lsx_get_millis());
 
   bool turn_off_sequence = false;
   bool turn_off_blink = false;
@@ -1055,28 +1978,14 @@ void dali_task(void* pvParameters)
         led_set(lamp_pins[i], value, value, value);
       }
 
-      uint8_t index = get_input_index(filter_value);
-      uint8_t brightness = 254; // dali.config.scenes[get_input_index(filter_value)];
-      for (uint32_t i = 0; i < dali.short_address_count; ++i)
+      bool inputs[3] = {};
+      for (uint32_t i = 0; i < array_size(inputs); ++i)
       {
-        if (index == dali.short_address[i])
-        {
-          lsx_delay_millis(delay_time);
-          dali_transmit(dali.short_address[i] << 1, 254);
-          lsx_delay_millis(delay_time);
-          dali_transmit(dali.short_address[i] << 1, 254);
-          lsx_delay_millis(delay_time);
-        }
-        else
-        {
-          lsx_delay_millis(delay_time);
-          dali_transmit(dali.short_address[i] << 1, 0);
-          lsx_delay_millis(delay_time);
-          dali_transmit(dali.short_address[i] << 1, 0);
-          lsx_delay_millis(delay_time);
-        }
-        vTaskDelay(pdMS_TO_TICKS(300));
+        dali.local_inputs[i] = filter_value[i];
+        inputs[i] = filter_value[i] || dali.remote_inputs[i];
       }
+      uint8_t brightness = 254; // dali.config.scenes[get_input_index(filter_value)];
+      dali_send_input_levels(inputs, 300);
 #if 0
       if (brightness != last_sent_brightness)
       {
@@ -1126,6 +2035,55 @@ void dali_task(void* pvParameters)
         lsx_log("%u ", filter_value[i]);
       }
       lsx_log("\n\n");
+
+      dali_bus_stats_t bus_stats = {};
+      dali_bus_get_stats(&bus_stats);
+      lsx_log("Bus: %lu frames, %lu backward, %lu frames/s\n", bus_stats.frames,
+              bus_stats.backward_frames, bus_stats.frames_per_second);
+      lsx_log("Bus: %lu collisions, %lu dropped, %lu deferred\n", bus_stats.collisions,
+              bus_stats.collision_failures, bus_stats.busy_deferrals);
+      uint32_t decoded = bus_stats.backward_frames + bus_stats.decode_failures +
+                         bus_stats.backward_collisions;
+      lsx_log("Bus: backward half bit %lu us, %lu/%lu decode failures, %lu collided\n",
+              bus_stats.backward_half_bit_us, bus_stats.decode_failures, decoded,
+              bus_stats.backward_collisions);
+      lsx_log("Bus: %lu events, %lu receive overruns, %lu queries coalesced\n",
+              bus_stats.events, bus_stats.receive_overruns, bus_stats.coalesced_queries);
+      for (uint32_t i = 0; i < DALI_CLASS_COUNT; ++i)
+      {
+        const dali_bus_class_stats_t* class_stats = &bus_stats.classes[i];
+        lsx_log("Bus class %lu: %lu frames, waited %lu us mean, %lu us max\n", i,
+                class_stats->frames, class_stats->wait_mean_us, class_stats->wait_max_us);
+      }
+      uint32_t inputs = max(g_input_latency.count, 1);
+      lsx_log("Input: %lu scenes, latency %lu us mean, %lu us max\n",
+              g_input_latency.count, (uint32_t)(g_input_latency.total_us / inputs),
+              g_input_latency.max_us);
+      dali_query_lock();
+      dali_query_stats_t query_stats = g_query_stats;
+      dali_query_unlock();
+      uint32_t queries = max(query_stats.queries, 1);
+      lsx_log("Query: %lu queries, %lu.%02lu samples each, %lu%% agreed, %lu failed\n",
+              query_stats.queries, query_stats.samples / queries,
+              ((query_stats.samples % queries) * 100) / queries,
+              (query_stats.agreed * 100) / queries, query_stats.failed);
+      lsx_log("Query: %lu answered from cache\n", query_stats.cache_hits);
+
+      uint32_t present = 0;
+      uint32_t missing = 0;
+      uint32_t failing = 0;
+      for (uint32_t i = 0; i < DALI_GEAR_COUNT; ++i)
+      {
+        dali_gear_t gear = {};
+        if (dali_gear_get(i, &gear))
+        {
+          present++;
+          missing += (gear.missed > 0) ? 1 : 0;
+          failing += ((gear.flags & DALI_GEAR_FAILURE_KNOWN) && gear.failure_status) ? 1 : 0;
+        }
+      }
+      lsx_log("Gear: %lu present, %lu not answering, %lu reporting failures\n", present,
+              missing, failing);
     }
 
     if (dali.config.blink_enabled && turn_off_sequence)
@@ -1228,6 +2186,10 @@ void dali_initialize(nvs_t* scenes_nvs, dali_config_t config)
   dali.config = config;
   dali.scene_nvs = scenes_nvs;
 
+  // Before the task starts: the web server asks for progress from then on.
+  g_query_lock = xSemaphoreCreateMutex();
+  g_table_lock = xSemaphoreCreateMutex();
+
   xTaskCreateStatic(dali_task, "DALI Task", DALI_STACK_SIZE, NULL, 3, dali_stack,
                     &dali_stack_type);
 }
@@ -9,6 +9,7 @@
 #define DALI_ON_DP               0b11111110
 #define DALI_OFF_DP              0b00000000
 #define DALI_ON                  0x05
+#define DALI_RECALL_MIN_LEVEL    0x06
 #define DALI_OFF                 0x00
 #define DALI_RESET               0b00100000
 #define DALI_DIMMING_LINEAR      0x01
@@ -20,6 +21,7 @@
 #define DALI_SET_FADE_RATE            0x2F
 #define DALI_SET_SYSTEM_FAILURE_LEVEL 0x2C
 #define DALI_SET_POWER_ON_LEVEL       0x2D
+#define DALI_SET_SHORT_ADDRESS        0x80
 
 #define DALI_UNKNOWN                    0x00
 #define DALI_QUERY_STATUS               0x90
@@ -37,6 +39,41 @@
 #define DALI_QUERY_FADE_TIME            0xA5
 #define DALI_QUERY_PHYSICAL_MINIMUM     0x9A
 
+// Queries answered with YES or not at all, which means NO.
+#define DALI_QUERY_CONTROL_GEAR_PRESENT  0x91
+#define DALI_QUERY_LAMP_FAILURE          0x92
+#define DALI_QUERY_LAMP_POWER_ON         0x93
+#define DALI_QUERY_LIMIT_ERROR           0x94
+#define DALI_QUERY_RESET_STATE           0x95
+#define DALI_QUERY_MISSING_SHORT_ADDRESS 0x96
+#define DALI_QUERY_POWER_FAILURE         0x9B
+
+#define DALI_YES 0xFF
+#define DALI_NO  0x00
+
+// Special commands, sent in place of the address byte.
+#define DALI_SPECIAL_FIRST        0xA1
+#define DALI_SPECIAL_LAST         0xCB
+#define DALI_TERMINATE             0xA1
+#define DALI_SET_DTR0              0xA3
+#define DALI_INITIALISE            0xA5
+#define DALI_RANDOMISE             0xA7
+#define DALI_COMPARE               0xA9
+#define DALI_WITHDRAW              0xAB
+#define DALI_PROGRAM_SHORT_ADDRESS 0xB7
+#define DALI_VERIFY_SHORT_ADDRESS  0xB9
+#define DALI_QUERY_SHORT_ADDRESS   0xBB
+
+// INITIALISE operands besides a short address.
+#define DALI_INITIALISE_ALL        0x00
+#define DALI_INITIALISE_UNADDRESSED 0xFF
+
+// Extended commands only reach gear of the device type enabled by the frame
+// right before them.
+#define DALI_ENABLE_DEVICE_TYPE 0xC1
+#define DALI_DEVICE_TYPE_LED    6
+#define DALI_EX_FIRST           0xE0
+
 #define DALI_EX_REFERENCE_SYSTEM_POWER      0xE0
 #define DALI_EX_ENABLE_CURRENT_PROTECTOR    0xE1
 #define DALI_EX_DISABLE_CURRENT_PROTECTOR   0xE2
@@ -76,4 +113,23 @@ void light_control_add_interrupt(void);
 void light_control_remove_interrupt(void);
 void dali_led_initialize(void);
 
+typedef struct dali_commission_progress_t
+{
+  bool running;
+  bool all_gear; // The run takes in all gear, not only new ones.
+  uint8_t percent;
+  uint32_t found;      // Gear found by the current or last run.
+  uint32_t gear_count; // Gear in the commissioning table.
+  uint32_t missing;    // Gear in the table that did not answer at boot.
+} dali_commission_progress_t;
+
+// Finds and addresses gear without a short address in the background,
+// keeping every existing address, while lighting control keeps running.
+// Returns false if commissioning is already running.
+bool dali_commission_new_gear(void);
+void dali_get_commission_progress(dali_commission_progress_t* progress_out);
+
+// Share of bus time, in percent, the background gear poller may use.
+void dali_set_poll_budget(uint8_t percent);
+
 #endif
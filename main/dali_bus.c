@@ -0,0 +1,1807 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <driver/rmt_tx.h>
+#include <driver/rmt_rx.h>
+#include <esp_attr.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+
+#include <string.h>
+
+#include "dali_bus.h"
+#include "dali_decode.h"
+#include "util.h"
+#include "platform.h"
+#include "pin_define.h"
+
+#define DALI_BUS_STACK_SIZE  4096
+#define DALI_BUS_QUEUE_COUNT 16
+
+#define DALI_BUS_TRANSACTION_FRAMES 16
+#define DALI_BUS_GAP_SYMBOL_MAX_US  (2 * 32767)
+
+#define DALI_BUS_IDLE_TIMEOUT_MS   250
+#define DALI_BUS_ANSWER_TIMEOUT_MS 50
+#define DALI_BUS_RX_IDLE_US        4000
+#define DALI_BUS_ECHO_TIMEOUT_MS   50
+
+// Allowance for the receive callback to run once the RX idle time is over.
+#define DALI_BUS_RX_LATENCY_US 1000
+
+#define DALI_BUS_COLLISION_RETRIES 3
+
+// IEC 62386-101 break condition sent on a collision, 1.2 to 1.4 ms active.
+#define DALI_BUS_BREAK_US 1300
+
+// Edges of an own frame have to land this close to a half-bit boundary.
+#define DALI_BUS_MONITOR_TOLERANCE_PERCENT 30
+
+// Receptions in flight between the receive callback and the bus task. The
+// callback re-arms into the next one straight away, so the line is watched
+// without a gap while the task works through earlier ones.
+#define DALI_BUS_RX_BUFFERS 4
+#define DALI_BUS_RX_SYMBOLS 64
+
+// Tasks that may set their own class for blocking calls.
+#define DALI_BUS_CLASS_TASKS 4
+
+#define DALI_BUS_INFLIGHT_COUNT   8
+#define DALI_BUS_INFLIGHT_WAITERS 4
+
+// Receivers have to accept half bits from 333 to 500 us, the backward frame
+// half-bit estimate is kept inside that.
+#define DALI_BACKWARD_HALF_BIT_MIN_US 333
+#define DALI_BACKWARD_HALF_BIT_MAX_US 500
+
+// A backward frame starts 5.5 to 10.5 ms after the forward frame ends, and
+// receivers have to accept one starting as late as 12.4 ms.
+#define DALI_BACKWARD_START_MAX_US 12400
+
+// IEC 62386-101 settling times, counted from the end of the stop condition
+// of one frame to the start bit of the next forward frame.
+#define DALI_SETTLE_FORWARD_US    13500
+#define DALI_SETTLE_SEND_TWICE_US 13500
+#define DALI_SETTLE_BACKWARD_US   2400
+
+// Settling window per multi-master priority, DALI_PRIORITY_TRANSACTION first.
+// A master picks a random time inside its window so two masters of the same
+// priority rarely start together.
+static const uint16_t g_settle_window_us[][2] = {
+  { 13500, 14700 }, { 14900, 16300 }, { 16300, 17700 }, { 17900, 19300 }, { 19500, 21100 },
+};
+
+// Queued by the receive callback to wake the bus task while it listens.
+#define DALI_FRAME_RECEIVED 0x80
+
+// Forward frames sent back to back in one RMT transmission, with the idle
+// time after each frame encoded as symbols so the hardware times the gaps.
+typedef struct dali_bus_transaction_t
+{
+  uint32_t frame_count;
+  uint8_t payload[DALI_BUS_TRANSACTION_FRAMES][DALI_FRAME_MAX_BITS / 8];
+  uint8_t payload_size[DALI_BUS_TRANSACTION_FRAMES];
+  uint32_t gap_us[DALI_BUS_TRANSACTION_FRAMES];
+} dali_bus_transaction_t;
+
+typedef struct dali_bus_t
+{
+  uint32_t half_bit_us;
+
+  uint32_t references;
+  uint32_t idle_timeout_ms;
+  bool enabled;
+
+  volatile uint32_t tx_done_us;
+  volatile uint32_t rx_done_us;
+
+  uint32_t next_frame_us;
+  bool after_backward;
+
+  volatile bool rx_armed;
+  volatile uint8_t rx_index;
+  volatile bool answer_pending;
+  volatile bool edge_interrupt;
+  volatile uint32_t rx_edge_us;
+  volatile bool listening;
+  volatile bool transmitting;
+  volatile bool monitor;
+  dali_bus_event_callback_t event_callback;
+  void* event_user_data;
+
+  // Measured backward frame half bit in 1/16 us.
+  uint32_t backward_half_bit_q4;
+
+  uint32_t burst_start_us;
+  uint32_t burst_frames;
+  dali_bus_stats_t stats;
+
+  // One queue per dali_bus_class_t. pending counts what is in all of them.
+  QueueHandle_t frame_queues[DALI_CLASS_COUNT];
+  SemaphoreHandle_t pending;
+  TaskHandle_t class_tasks[DALI_BUS_CLASS_TASKS];
+  uint8_t task_classes[DALI_BUS_CLASS_TASKS];
+  uint64_t class_wait_total_us[DALI_CLASS_COUNT];
+  TaskHandle_t task;
+} dali_bus_t;
+
+static StackType_t dali_bus_stack[DALI_BUS_STACK_SIZE] = {};
+static StaticTask_t dali_bus_stack_type = {};
+
+static dali_bus_t g_bus = {};
+
+static rmt_channel_handle_t g_rmt_tx_channel;
+static rmt_channel_handle_t g_rmt_rx_channel;
+
+static rmt_encoder_handle_t g_rmt_encoder;
+static rmt_encoder_handle_t g_rmt_copy_encoder;
+
+static SemaphoreHandle_t g_bus_lock;
+
+// Guards g_bus.stats and the wait totals, which the receive callback and the
+// bus task write and any task reads.
+static portMUX_TYPE g_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static lsx_timer_handle_t g_bus_idle_timer;
+static lsx_timer_handle_t g_bus_settle_timer;
+
+// A finished reception stays in its buffer, only the index is queued. The
+// callback fills a buffer and the bus task releases it once decoded.
+typedef struct dali_bus_reception_t
+{
+  rmt_symbol_word_t symbols[DALI_BUS_RX_SYMBOLS];
+  uint32_t symbol_count;
+  uint32_t done_us;
+  volatile bool busy;
+} dali_bus_reception_t;
+
+static QueueHandle_t receive_queue = NULL;
+
+static dali_bus_reception_t g_receptions[DALI_BUS_RX_BUFFERS] = {};
+
+static const rmt_receive_config_t g_receive_config = {
+  .signal_range_min_ns = 2000,
+  .signal_range_max_ns = DALI_BUS_RX_IDLE_US * 1000,
+};
+
+// A query queued or on the bus. An identical query enqueued meanwhile waits
+// here for the same answer instead of going on the bus again.
+typedef struct dali_bus_inflight_t
+{
+  uint32_t data;
+  uint8_t bits;
+  uint8_t bus_class;
+  uint8_t waiter_count;
+  bool used;
+  dali_frame_t waiters[DALI_BUS_INFLIGHT_WAITERS];
+} dali_bus_inflight_t;
+
+static dali_bus_inflight_t g_inflight[DALI_BUS_INFLIGHT_COUNT] = {};
+static SemaphoreHandle_t g_inflight_lock;
+
+// Single producer, the bus task, and a single reader. Each side only
+// writes its own index.
+static dali_capture_t g_captures[DALI_BUS_CAPTURE_COUNT] = {};
+static uint32_t g_capture_head = 0;
+static uint32_t g_capture_tail = 0;
+
+// The transaction on the wire as the receive pin interrupt checks it, edge by
+// edge. Every edge of a frame is timed from its start bit and has to turn the
+// line to the level sent in that half bit; the first one that does not is a
+// collision. Only the edge interrupt writes the fields below armed.
+typedef struct dali_bus_monitor_t
+{
+  const dali_bus_transaction_t* transaction;
+  volatile bool armed;
+  volatile bool collision;
+
+  uint32_t frame;
+  bool in_frame;
+  uint32_t start_us;
+  uint32_t half;
+  uint8_t level;
+} dali_bus_monitor_t;
+
+static dali_bus_monitor_t g_monitor = {};
+
+// One Manchester symbol per bit, MSB first, for every byte value at the
+// current half-bit time. A forward frame is a start bit followed by these.
+static rmt_symbol_word_t g_manchester_table[256][8] = {};
+static rmt_symbol_word_t g_manchester_start = {};
+
+// rmt_receive() is called from here, which needs CONFIG_RMT_RECV_FUNC_IN_IRAM.
+static bool rmt_rx_done_callback(rmt_channel_handle_t rx_chan,
+                                 const rmt_rx_done_event_data_t* edata, void* user_ctx)
+{
+  uint8_t index = g_bus.rx_index;
+  dali_bus_reception_t* reception = &g_receptions[index];
+  reception->symbol_count = edata->num_symbols;
+  reception->done_us = lsx_get_micro();
+  reception->busy = true;
+  g_bus.rx_done_us = reception->done_us;
+
+  uint8_t next = (index + 1) % DALI_BUS_RX_BUFFERS;
+  if (!g_receptions[next].busy)
+  {
+    g_bus.rx_index = next;
+    rmt_receive(rx_chan, g_receptions[next].symbols, sizeof(g_receptions[next].symbols),
+                &g_receive_config);
+  }
+  else
+  {
+    // The bus task re-arms once it releases a buffer.
+    g_bus.rx_armed = false;
+    portENTER_CRITICAL_ISR(&g_stats_lock);
+    g_bus.stats.receive_overruns++;
+    portEXIT_CRITICAL_ISR(&g_stats_lock);
+  }
+
+  QueueHandle_t receive_queue = (QueueHandle_t)user_ctx;
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(receive_queue, &index, &woken);
+  if (g_bus.answer_pending)
+  {
+    vTaskNotifyGiveFromISR(g_bus.task, &woken);
+  }
+  if (g_bus.listening)
+  {
+    dali_frame_t wake = { .flags = DALI_FRAME_RECEIVED };
+    if (xQueueSendFromISR(g_bus.frame_queues[DALI_CLASS_CONTROL], &wake, &woken) ==
+        pdPASS)
+    {
+      xSemaphoreGiveFromISR(g_bus.pending, &woken);
+    }
+  }
+  return woken == pdTRUE;
+}
+
+// Level sent in half bit number half of a frame: the start bit, then the bits
+// MSB first, then idle.
+static inline IRAM_ATTR uint8_t dali_bus_sent_level(
+  const dali_bus_transaction_t* transaction, uint32_t frame, uint32_t half)
+{
+  if (half < 2)
+  {
+    return (half == 0) ? 1 : 0;
+  }
+  uint32_t bit = (half - 2) / 2;
+  if (bit >= (transaction->payload_size[frame] * 8u))
+  {
+    return 0;
+  }
+  uint8_t value = (transaction->payload[frame][bit >> 3] >> (7 - (bit & 0x07))) & 0x01;
+  return (half & 0x01) ? !value : value;
+}
+
+// Every edge toggles the level; the first one after idle starts a frame.
+static inline IRAM_ATTR bool dali_bus_monitor_edge(dali_bus_monitor_t* monitor,
+                                                   uint32_t edge_us)
+{
+  const dali_bus_transaction_t* transaction = monitor->transaction;
+  uint32_t half_bit_us = g_bus.half_bit_us;
+  if (!monitor->in_frame)
+  {
+    monitor->in_frame = true;
+    monitor->start_us = edge_us;
+    monitor->half = 0;
+    monitor->level = 1;
+    return true;
+  }
+
+  uint32_t elapsed_us = edge_us - monitor->start_us;
+  uint32_t half = (elapsed_us + (half_bit_us / 2)) / half_bit_us;
+  int32_t offset_us = (int32_t)(elapsed_us - (half * half_bit_us));
+  int32_t tolerance_us = (half_bit_us * DALI_BUS_MONITOR_TOLERANCE_PERCENT) / 100;
+  if ((half <= monitor->half) || (offset_us > tolerance_us) ||
+      (offset_us < -tolerance_us))
+  {
+    return false;
+  }
+  // The line held its level since the last edge and now turns to the next.
+  for (uint32_t i = monitor->half; i < half; ++i)
+  {
+    if (dali_bus_sent_level(transaction, monitor->frame, i) != monitor->level)
+    {
+      return false;
+    }
+  }
+  monitor->level = !monitor->level;
+  if (dali_bus_sent_level(transaction, monitor->frame, half) != monitor->level)
+  {
+    return false;
+  }
+  monitor->half = half;
+
+  uint32_t frame_halves = 2 + (transaction->payload_size[monitor->frame] * 16u);
+  if ((monitor->level == 0) && ((half + 1) >= frame_halves))
+  {
+    monitor->in_frame = false;
+    if ((++monitor->frame) >= transaction->frame_count)
+    {
+      monitor->armed = false;
+    }
+  }
+  return true;
+}
+
+// Runs from the GPIO ISR service, which stays enabled while the flash cache
+// is off, so it only touches IRAM and DRAM.
+static void IRAM_ATTR dali_bus_rx_edge(void* arguments)
+{
+  uint32_t edge_us = (uint32_t)esp_timer_get_time();
+  g_bus.rx_edge_us = edge_us;
+  if (g_monitor.armed && !dali_bus_monitor_edge(&g_monitor, edge_us))
+  {
+    g_monitor.armed = false;
+    g_monitor.collision = true;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(g_bus.task, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+
+static bool rmt_tx_done_callback(rmt_channel_handle_t tx_chan,
+                                 const rmt_tx_done_event_data_t* edata, void* user_ctx)
+{
+  g_bus.tx_done_us = lsx_get_micro();
+  return false;
+}
+
+static rmt_rx_event_callbacks_t callbacks = {
+  .on_recv_done = rmt_rx_done_callback,
+};
+
+static rmt_tx_event_callbacks_t tx_callbacks = {
+  .on_trans_done = rmt_tx_done_callback,
+};
+
+static inline void dali_bus_count(uint32_t* counter)
+{
+  portENTER_CRITICAL(&g_stats_lock);
+  (*counter)++;
+  portEXIT_CRITICAL(&g_stats_lock);
+}
+
+static void dali_bus_build_manchester_table(uint32_t half_bit_us)
+{
+  for (uint32_t byte = 0; byte < array_size(g_manchester_table); ++byte)
+  {
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+      uint8_t bit = (byte >> (7 - i)) & 0x01;
+      rmt_symbol_word_t* symbol = &g_manchester_table[byte][i];
+      symbol->duration0 = half_bit_us;
+      symbol->duration1 = half_bit_us;
+      symbol->level0 = bit;
+      symbol->level1 = !bit;
+    }
+  }
+  g_manchester_start = g_manchester_table[0xFF][0];
+}
+
+static inline size_t dali_bus_gap_symbols(uint32_t gap_us)
+{
+  return (gap_us + DALI_BUS_GAP_SYMBOL_MAX_US - 1) / DALI_BUS_GAP_SYMBOL_MAX_US;
+}
+
+// Idle (bus high) symbol number index of a gap. Neither half may be zero as
+// that would end the transmission.
+static inline rmt_symbol_word_t dali_bus_gap_symbol(uint32_t gap_us, size_t index)
+{
+  uint32_t duration = min(gap_us - (index * DALI_BUS_GAP_SYMBOL_MAX_US),
+                          DALI_BUS_GAP_SYMBOL_MAX_US);
+  rmt_symbol_word_t symbol = {};
+  symbol.level0 = 0;
+  symbol.level1 = 0;
+  symbol.duration0 = (duration + 1) / 2;
+  symbol.duration1 = max(duration / 2, 1);
+  return symbol;
+}
+
+// Simple-encoder callback: data is a dali_bus_transaction_t whose frames are
+// 2-4 byte payloads, MSB first. May be called from the RMT ISR to refill, so
+// it only does table lookups.
+static size_t IRAM_ATTR dali_bus_encode(const void* data, size_t data_size,
+                                        size_t symbols_written, size_t symbols_free,
+                                        rmt_symbol_word_t* symbols, bool* done,
+                                        void* arg)
+{
+  const dali_bus_transaction_t* transaction = (const dali_bus_transaction_t*)data;
+  size_t position = symbols_written;
+  size_t frame_start = 0;
+  size_t count = 0;
+  for (uint32_t f = 0; f < transaction->frame_count; ++f)
+  {
+    const uint8_t* bytes = transaction->payload[f];
+    size_t bit_symbols = 1 + (transaction->payload_size[f] * 8);
+    size_t frame_end = frame_start + bit_symbols +
+                       dali_bus_gap_symbols(transaction->gap_us[f]);
+    while ((position < frame_end) && (count < symbols_free))
+    {
+      size_t i = position - frame_start;
+      if (i == 0)
+      {
+        symbols[count++] = g_manchester_start;
+      }
+      else if (i < bit_symbols)
+      {
+        symbols[count++] = g_manchester_table[bytes[(i - 1) >> 3]][(i - 1) & 0x07];
+      }
+      else
+      {
+        symbols[count++] = dali_bus_gap_symbol(transaction->gap_us[f], i - bit_symbols);
+      }
+      position++;
+    }
+    frame_start = frame_end;
+  }
+  (*done) = (position >= frame_start);
+  return count;
+}
+
+static uint32_t dali_bus_payload(uint32_t data, uint8_t bits, uint8_t* payload)
+{
+  uint32_t byte_count = bits / 8;
+  for (uint32_t i = 0; i < byte_count; ++i)
+  {
+    payload[i] = (data >> (bits - (8 * (i + 1)))) & 0xFF;
+  }
+  return byte_count;
+}
+
+static void dali_bus_initialize_rmt(void)
+{
+  receive_queue = xQueueCreate(DALI_BUS_RX_BUFFERS, sizeof(uint8_t));
+
+  rmt_tx_channel_config_t tx_cfg = {
+    .gpio_num = DALI_TX,
+    .clk_src = RMT_CLK_SRC_DEFAULT,
+    .resolution_hz = 1000000,
+    .mem_block_symbols = 64,
+    .trans_queue_depth = 1,
+  };
+  rmt_new_tx_channel(&tx_cfg, &g_rmt_tx_channel);
+  rmt_tx_register_event_callbacks(g_rmt_tx_channel, &tx_callbacks, NULL);
+
+  rmt_rx_channel_config_t rx_cfg = {
+    .gpio_num = DALI_RX,
+    .clk_src = RMT_CLK_SRC_DEFAULT,
+    .resolution_hz = 1000000,
+    .mem_block_symbols = 64,
+  };
+  rmt_new_rx_channel(&rx_cfg, &g_rmt_rx_channel);
+  rmt_rx_register_event_callbacks(g_rmt_rx_channel, &callbacks, receive_queue);
+
+  rmt_simple_encoder_config_t encoder_config = {
+    .callback = dali_bus_encode,
+    .min_chunk_size = 1,
+  };
+  rmt_new_simple_encoder(&encoder_config, &g_rmt_encoder);
+
+  rmt_copy_encoder_config_t copy_config = {};
+  rmt_new_copy_encoder(&copy_config, &g_rmt_copy_encoder);
+}
+
+// Both channels stay enabled while anyone holds the bus and for
+// idle_timeout_ms after the last release, so a burst of frames only pays
+// the channel power-up once.
+static void dali_bus_idle_callback(void* arguments)
+{
+  xSemaphoreTake(g_bus_lock, portMAX_DELAY);
+  if ((g_bus.references == 0) && g_bus.enabled)
+  {
+    rmt_disable(g_rmt_rx_channel);
+    rmt_disable(g_rmt_tx_channel);
+    g_bus.rx_armed = false;
+    g_bus.enabled = false;
+  }
+  xSemaphoreGive(g_bus_lock);
+}
+
+void dali_bus_set_idle_timeout(uint32_t timeout_ms)
+{
+  g_bus.idle_timeout_ms = max(timeout_ms, 1);
+}
+
+void dali_bus_begin(void)
+{
+  xSemaphoreTake(g_bus_lock, portMAX_DELAY);
+  if ((g_bus.references++) == 0)
+  {
+    lsx_timer_stop(g_bus_idle_timer);
+    if (!g_bus.enabled)
+    {
+      rmt_enable(g_rmt_tx_channel);
+      rmt_enable(g_rmt_rx_channel);
+      g_bus.enabled = true;
+    }
+  }
+  xSemaphoreGive(g_bus_lock);
+}
+
+void dali_bus_end(void)
+{
+  xSemaphoreTake(g_bus_lock, portMAX_DELAY);
+  if ((g_bus.references > 0) && ((--g_bus.references) == 0))
+  {
+    lsx_timer_start(g_bus_idle_timer, (uint64_t)g_bus.idle_timeout_ms * 1000ULL,
+                    false);
+  }
+  xSemaphoreGive(g_bus_lock);
+}
+
+static bool dali_bus_transaction_add(dali_bus_transaction_t* transaction,
+                                     uint32_t data, uint8_t bits)
+{
+  if (transaction->frame_count >= DALI_BUS_TRANSACTION_FRAMES)
+  {
+    return false;
+  }
+  uint32_t index = transaction->frame_count++;
+  transaction->payload_size[index] =
+    dali_bus_payload(data, bits, transaction->payload[index]);
+  transaction->gap_us[index] = 0;
+  return true;
+}
+
+// Idle time after the last frame added, counted from its last bit.
+static void dali_bus_transaction_gap(dali_bus_transaction_t* transaction,
+                                     uint32_t settling_us)
+{
+  if (transaction->frame_count > 0)
+  {
+    uint32_t stop_condition_us = 4 * g_bus.half_bit_us;
+    transaction->gap_us[transaction->frame_count - 1] = stop_condition_us + settling_us;
+  }
+}
+
+static uint32_t dali_bus_transaction_timeout_ms(const dali_bus_transaction_t* transaction)
+{
+  uint32_t timeout_ms = 100;
+  for (uint32_t i = 0; i < transaction->frame_count; ++i)
+  {
+    timeout_ms += (transaction->gap_us[i] / 1000) + 20;
+  }
+  return timeout_ms;
+}
+
+#if DALI_BENCHMARK
+// Plain transmission with no arbitration, for measuring the RMT overhead.
+static void dali_bus_transmit_(uint32_t data, uint8_t bits)
+{
+  dali_bus_transaction_t transaction = {};
+  dali_bus_transaction_add(&transaction, data, bits);
+
+  rmt_transmit_config_t tx_cfg = { .loop_count = 0 };
+  rmt_transmit(g_rmt_tx_channel, g_rmt_encoder, &transaction, sizeof(transaction),
+               &tx_cfg);
+  rmt_tx_wait_all_done(g_rmt_tx_channel, dali_bus_transaction_timeout_ms(&transaction));
+  lsx_gpio_write(DALI_TX, LSX_GPIO_LOW);
+}
+#endif
+
+// Only needed for the first receive after the channel was enabled, or after
+// the callback ran out of free buffers; otherwise the callback keeps
+// reception armed by itself.
+static void dali_bus_arm_receive(void)
+{
+  if (g_bus.rx_armed || !g_bus.enabled)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < DALI_BUS_RX_BUFFERS; ++i)
+  {
+    uint8_t index = (g_bus.rx_index + i) % DALI_BUS_RX_BUFFERS;
+    if (!g_receptions[index].busy)
+    {
+      g_bus.rx_index = index;
+      g_bus.rx_armed = true;
+      rmt_receive(g_rmt_rx_channel, g_receptions[index].symbols,
+                  sizeof(g_receptions[index].symbols), &g_receive_config);
+      return;
+    }
+  }
+}
+
+static void dali_bus_capture(const dali_bus_reception_t* reception);
+
+// Every reception passes through here, so monitor mode records each one as
+// the bus task takes it up, own echoes included.
+static dali_bus_reception_t* dali_bus_next_reception(TickType_t wait)
+{
+  uint8_t index = 0;
+  if (xQueueReceive(receive_queue, &index, wait) != pdPASS)
+  {
+    return NULL;
+  }
+  dali_bus_reception_t* reception = &g_receptions[index];
+  if (g_bus.monitor)
+  {
+    dali_bus_capture(reception);
+  }
+  return reception;
+}
+
+// Hands the buffer back to the callback.
+static void dali_bus_release(dali_bus_reception_t* reception)
+{
+  reception->busy = false;
+  dali_bus_arm_receive();
+}
+
+// Runs the levels of a reception through the streaming decoder. The receiver
+// ends a reception with a zero duration once the line has gone idle.
+static dali_decode_result_t dali_bus_decode(const dali_bus_reception_t* reception,
+                                            uint32_t half_bit_us,
+                                            dali_decoder_t* decoder)
+{
+  dali_decoder_begin(decoder, half_bit_us);
+  for (uint32_t i = 0; i < reception->symbol_count; ++i)
+  {
+    rmt_symbol_word_t symbol = reception->symbols[i];
+    dali_decoder_push(decoder, symbol.level0, symbol.duration0);
+    dali_decoder_push(decoder, symbol.level1, symbol.duration1);
+  }
+  return dali_decoder_end(decoder);
+}
+
+// Follows the half bit of clean backward frames, so gear running a little
+// off nominal still decodes with the split point between its own short and
+// long levels.
+static void dali_bus_calibrate(uint32_t half_bit_us)
+{
+  int32_t measured_q4 = (int32_t)(half_bit_us * 16);
+  int32_t estimate_q4 = (int32_t)g_bus.backward_half_bit_q4;
+  estimate_q4 += (measured_q4 - estimate_q4) / 8;
+  g_bus.backward_half_bit_q4 = min(max((uint32_t)estimate_q4,
+                                       DALI_BACKWARD_HALF_BIT_MIN_US * 16),
+                                   DALI_BACKWARD_HALF_BIT_MAX_US * 16);
+  portENTER_CRITICAL(&g_stats_lock);
+  g_bus.stats.backward_half_bit_us = g_bus.backward_half_bit_q4 / 16;
+  portEXIT_CRITICAL(&g_stats_lock);
+}
+
+// Runs on the bus task, the receive callback only queues the buffer. The line
+// has been idle for the RX idle time when the receive completes, which dates
+// the last edge.
+static void dali_bus_capture(const dali_bus_reception_t* reception)
+{
+  if (reception->symbol_count == 0)
+  {
+    return;
+  }
+  uint32_t head = g_capture_head;
+  uint32_t tail = __atomic_load_n(&g_capture_tail, __ATOMIC_ACQUIRE);
+  if ((head - tail) >= DALI_BUS_CAPTURE_COUNT)
+  {
+    dali_bus_count(&g_bus.stats.captures_dropped);
+    return;
+  }
+
+  uint32_t duration_us = 0;
+  for (uint32_t i = 0; i < reception->symbol_count; ++i)
+  {
+    duration_us += reception->symbols[i].duration0;
+    duration_us += reception->symbols[i].duration1;
+  }
+
+  dali_capture_t* capture = &g_captures[head % DALI_BUS_CAPTURE_COUNT];
+  capture->time_us = reception->done_us - DALI_BUS_RX_IDLE_US - duration_us;
+  capture->duration_us = (uint16_t)min(duration_us, UINT16_MAX);
+  capture->data = 0;
+  capture->bits = 0;
+  capture->type = DALI_CAPTURE_ERROR;
+
+  dali_decoder_t decoder;
+  switch (dali_bus_decode(reception, g_bus.half_bit_us, &decoder))
+  {
+    case DALI_DECODE_FRAME:
+    {
+      capture->data = decoder.data;
+      capture->bits = decoder.bits;
+      capture->type = (decoder.bits == 8) ? DALI_CAPTURE_BACKWARD : DALI_CAPTURE_FORWARD;
+      break;
+    }
+    case DALI_DECODE_COLLISION:
+    {
+      capture->type = DALI_CAPTURE_COLLISION;
+      break;
+    }
+    default: break;
+  }
+  if (g_bus.transmitting)
+  {
+    capture->type |= DALI_CAPTURE_OWN;
+  }
+
+  __atomic_store_n(&g_capture_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Waits for the reception of the backward frame, which is already armed
+// from when the echo came in. Silence is known as soon as the start window
+// closes without an edge; a frame that did start is waited for until the
+// receiver sees the line go idle after it. Without the edge interrupt the
+// wait has to allow for the latest possible frame. timeout_ms is the
+// upper bound either way.
+static dali_bus_reception_t* dali_bus_wait_backward_frame(uint32_t timeout_ms)
+{
+  uint32_t forward_end_us = g_bus.tx_done_us;
+  uint32_t timeout_us = forward_end_us + (timeout_ms * 1000);
+  uint32_t frame_us = 18 * g_bus.half_bit_us;
+
+  g_bus.answer_pending = true;
+  dali_bus_reception_t* reception = NULL;
+  while (!(reception = dali_bus_next_reception(0)))
+  {
+    uint32_t deadline_us = forward_end_us + DALI_BACKWARD_START_MAX_US;
+    uint32_t edge_us = g_bus.rx_edge_us;
+    if (!g_bus.edge_interrupt)
+    {
+      deadline_us += frame_us + DALI_BUS_RX_IDLE_US + DALI_BUS_RX_LATENCY_US;
+    }
+    else if ((int32_t)(edge_us - forward_end_us) > (int32_t)g_bus.half_bit_us)
+    {
+      uint32_t done_us = edge_us + DALI_BUS_RX_IDLE_US + DALI_BUS_RX_LATENCY_US;
+      if ((int32_t)(done_us - deadline_us) > 0)
+      {
+        deadline_us = done_us;
+      }
+    }
+    if ((int32_t)(deadline_us - timeout_us) > 0)
+    {
+      deadline_us = timeout_us;
+    }
+
+    int32_t remaining_us = (int32_t)(deadline_us - lsx_get_micro());
+    if (remaining_us <= 0)
+    {
+      break;
+    }
+    lsx_timer_start(g_bus_settle_timer, remaining_us, false);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  g_bus.answer_pending = false;
+  lsx_timer_stop(g_bus_settle_timer);
+  return reception;
+}
+
+static dali_frame_status_t dali_bus_read_response(uint32_t timeout_ms,
+                                                  uint8_t* response_out)
+{
+  dali_bus_arm_receive();
+
+  dali_bus_reception_t* reception = dali_bus_wait_backward_frame(timeout_ms);
+
+  dali_frame_status_t result = DALI_FRAME_NO_ANSWER;
+
+  uint8_t response = 0;
+
+  if (reception)
+  {
+    dali_decoder_t decoder;
+    dali_decode_result_t decoded =
+      dali_bus_decode(reception, g_bus.backward_half_bit_q4 / 16, &decoder);
+    if ((decoded == DALI_DECODE_FRAME) && (decoder.bits == 8))
+    {
+      dali_bus_calibrate(dali_decoder_half_bit_us(&decoder));
+      response = (uint8_t)decoder.data;
+      result = DALI_FRAME_ANSWER;
+    }
+    else if (decoded != DALI_DECODE_SILENCE)
+    {
+#if !defined(LSX_RELEASE)
+      printf("SYMBOLS: %lu\n", reception->symbol_count);
+      for (uint32_t i = 0; i < reception->symbol_count; ++i)
+      {
+        printf("Level 0: %u\n", reception->symbols[i].level0);
+        printf("Duration 0: %u\n", reception->symbols[i].duration0);
+        printf("Level 1: %u\n", reception->symbols[i].level1);
+        printf("Duration 1: %u\n", reception->symbols[i].duration1);
+      }
+#endif
+      // Several gear answering at once is a collision, which still means
+      // someone answered.
+      if (decoded == DALI_DECODE_COLLISION)
+      {
+        dali_bus_count(&g_bus.stats.backward_collisions);
+      }
+      else
+      {
+        dali_bus_count(&g_bus.stats.decode_failures);
+      }
+      result = DALI_FRAME_INVALID;
+    }
+    dali_bus_release(reception);
+  }
+
+  if (response_out) (*response_out) = response;
+
+  return result;
+}
+
+// Checks the echo of a forward frame against what was sent. Another master
+// driving the line at the same time breaks either the timing or the bits.
+static bool dali_bus_echo_matches(const dali_bus_reception_t* reception,
+                                  const uint8_t* payload, uint32_t payload_size)
+{
+  uint32_t expected = 0;
+  for (uint32_t i = 0; i < payload_size; ++i)
+  {
+    expected = (expected << 8) | payload[i];
+  }
+  dali_decoder_t decoder;
+  return (dali_bus_decode(reception, g_bus.half_bit_us, &decoder) == DALI_DECODE_FRAME) &&
+         (decoder.bits == (payload_size * 8)) && (decoder.data == expected);
+}
+
+static uint32_t dali_bus_priority_delay_us(uint8_t priority)
+{
+  // The settling time after a backward frame belongs to the transaction.
+  if (g_bus.after_backward)
+  {
+    return 0;
+  }
+  priority = min(max(priority, DALI_PRIORITY_TRANSACTION), DALI_PRIORITY_PERIODIC);
+  const uint16_t* window = g_settle_window_us[priority - 1];
+  return (window[0] - DALI_SETTLE_FORWARD_US) + (esp_random() % (window[1] - window[0]));
+}
+
+// The line went idle at the end of a frame we did not send.
+static void dali_bus_foreign_frame(void)
+{
+  uint32_t stop_condition_us = 4 * g_bus.half_bit_us;
+  g_bus.next_frame_us = g_bus.rx_done_us - DALI_BUS_RX_IDLE_US + stop_condition_us +
+                        DALI_SETTLE_FORWARD_US;
+  g_bus.after_backward = false;
+}
+
+// A frame from another master: restarts the settling time and is handed to
+// the event callback if it decodes as a forward frame.
+static void dali_bus_receive_event(dali_bus_reception_t* reception)
+{
+  dali_bus_foreign_frame();
+
+  dali_decoder_t decoder;
+  dali_decode_result_t decoded = dali_bus_decode(reception, g_bus.half_bit_us, &decoder);
+  dali_bus_release(reception);
+  if ((decoded == DALI_DECODE_FRAME) &&
+      ((decoder.bits == 16) || (decoder.bits == 24)) && g_bus.event_callback)
+  {
+    dali_bus_count(&g_bus.stats.events);
+    g_bus.event_callback(decoder.data, decoder.bits, g_bus.event_user_data);
+  }
+}
+
+static void dali_bus_settle_callback(void* arguments)
+{
+  xTaskNotifyGive(g_bus.task);
+}
+
+// Sleeps on a one-shot timer, the tick is far too coarse for settling times.
+// A notification left over from waiting for a backward frame only costs
+// another round.
+static void dali_bus_wait_until(uint32_t when_us)
+{
+  int32_t remaining_us = (int32_t)(when_us - lsx_get_micro());
+  while (remaining_us > 0)
+  {
+    lsx_timer_start(g_bus_settle_timer, remaining_us, false);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    remaining_us = (int32_t)(when_us - lsx_get_micro());
+  }
+}
+
+// Waits out the settling time for the priority with the receiver armed, so
+// a frame from another master restarts the wait instead of colliding. Leaves
+// the receiver armed to capture the echo.
+static void dali_bus_acquire(uint8_t priority)
+{
+  dali_bus_arm_receive();
+  while (true)
+  {
+    dali_bus_wait_until(g_bus.next_frame_us + dali_bus_priority_delay_us(priority));
+
+    // An active line means a frame is on the wire right now.
+    // An active line held for longer than any frame is not waited for.
+    bool active = lsx_gpio_read(DALI_RX);
+    TickType_t wait = active ? pdMS_TO_TICKS(DALI_BUS_ECHO_TIMEOUT_MS) : 0;
+    dali_bus_reception_t* reception = dali_bus_next_reception(wait);
+    if (!reception)
+    {
+      return;
+    }
+
+    dali_bus_count(&g_bus.stats.busy_deferrals);
+    dali_bus_receive_event(reception);
+  }
+}
+
+// Waits for the echo of a frame, or until the edge interrupt sees a collision.
+static dali_bus_reception_t* dali_bus_next_echo(uint32_t timeout_ms)
+{
+  uint32_t deadline_us = lsx_get_micro() + (timeout_ms * 1000);
+  g_bus.answer_pending = true;
+  dali_bus_reception_t* reception = NULL;
+  while (!(reception = dali_bus_next_reception(0)) && !g_monitor.collision)
+  {
+    int32_t remaining_us = (int32_t)(deadline_us - lsx_get_micro());
+    if (remaining_us <= 0)
+    {
+      break;
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(remaining_us / 1000) + 1);
+  }
+  g_bus.answer_pending = false;
+  return reception;
+}
+
+// Holds the line active long enough that every receiver drops the frame and
+// the other master stops as well.
+static void dali_bus_send_break(void)
+{
+  rmt_symbol_word_t symbol = {};
+  symbol.level0 = 1;
+  symbol.duration0 = DALI_BUS_BREAK_US;
+  symbol.level1 = 0;
+  symbol.duration1 = 1;
+  rmt_transmit_config_t tx_cfg = { .loop_count = 0 };
+  rmt_transmit(g_rmt_tx_channel, g_rmt_copy_encoder, &symbol, sizeof(symbol), &tx_cfg);
+  rmt_tx_wait_all_done(g_rmt_tx_channel, DALI_BUS_ECHO_TIMEOUT_MS);
+}
+
+// Sends the transaction with the receiver armed by dali_bus_acquire(). The
+// edge interrupt checks every half bit while it goes out, and the echo of
+// every frame is compared as it comes in, which the rotating receive buffers
+// allow without a gap between frames. On a collision the rest of the
+// transaction is dropped; one caught by the edge interrupt also cuts the
+// frame short and sends the break.
+static bool dali_bus_transmit_checked(const dali_bus_transaction_t* transaction)
+{
+  rmt_transmit_config_t tx_cfg = { .loop_count = 0 };
+  g_bus.transmitting = true;
+  g_monitor.transaction = transaction;
+  g_monitor.frame = 0;
+  g_monitor.in_frame = false;
+  g_monitor.collision = false;
+  g_monitor.armed = g_bus.edge_interrupt;
+  rmt_transmit(g_rmt_tx_channel, g_rmt_encoder, transaction, sizeof(*transaction),
+               &tx_cfg);
+
+  bool collision = false;
+  uint32_t frame = 0;
+  uint32_t timeout_ms = DALI_BUS_ECHO_TIMEOUT_MS;
+  for (; frame < transaction->frame_count; ++frame)
+  {
+    dali_bus_reception_t* echo = dali_bus_next_echo(timeout_ms);
+    if (g_monitor.collision)
+    {
+      collision = true;
+      if (echo)
+      {
+        dali_bus_release(echo);
+      }
+      break;
+    }
+    if (!echo)
+    {
+      // No echo at all, the receive side is not wired to the line.
+      break;
+    }
+    collision = !dali_bus_echo_matches(echo, transaction->payload[frame],
+                                       transaction->payload_size[frame]);
+    dali_bus_release(echo);
+    if (collision)
+    {
+      break;
+    }
+    timeout_ms = DALI_BUS_ECHO_TIMEOUT_MS + (transaction->gap_us[frame] / 1000);
+  }
+  g_monitor.armed = false;
+
+  if (g_monitor.collision)
+  {
+    rmt_disable(g_rmt_tx_channel);
+    rmt_enable(g_rmt_tx_channel);
+    dali_bus_send_break();
+    // The cut frame and the break end up in one reception; the settling time
+    // for the retry counts from its end.
+    dali_bus_reception_t* rest =
+      dali_bus_next_reception(pdMS_TO_TICKS(DALI_BUS_ECHO_TIMEOUT_MS));
+    if (rest)
+    {
+      dali_bus_release(rest);
+    }
+  }
+  else if (collision && ((frame + 1) < transaction->frame_count))
+  {
+    rmt_disable(g_rmt_tx_channel);
+    rmt_enable(g_rmt_tx_channel);
+  }
+  else
+  {
+    rmt_tx_wait_all_done(g_rmt_tx_channel, dali_bus_transaction_timeout_ms(transaction));
+  }
+  g_bus.transmitting = false;
+  lsx_gpio_write(DALI_TX, LSX_GPIO_LOW);
+  return !collision;
+}
+
+// IEC 62386-101 multi-master transmission. A collision is caught on the first
+// half bit that differs from what was sent and answered with the break, after
+// which every master waits out the settling time again. The retry backs off
+// into a lower priority window each time, which lets the other master through.
+static dali_frame_status_t dali_bus_transmit_arbitrated(
+  const dali_bus_transaction_t* transaction, uint8_t priority)
+{
+  if (priority == 0)
+  {
+    priority = DALI_PRIORITY_USER;
+  }
+  for (uint32_t attempt = 0;; ++attempt)
+  {
+    dali_bus_acquire(priority + attempt);
+    if (dali_bus_transmit_checked(transaction))
+    {
+      return DALI_FRAME_SENT;
+    }
+
+    dali_bus_count(&g_bus.stats.collisions);
+    dali_bus_foreign_frame();
+    if (attempt >= DALI_BUS_COLLISION_RETRIES)
+    {
+      dali_bus_count(&g_bus.stats.collision_failures);
+      return DALI_FRAME_COLLISION;
+    }
+  }
+}
+
+// Works out when the next forward frame may start from when the last one
+// actually left the wire.
+static void dali_bus_schedule_next(dali_frame_status_t status, uint32_t frame_count)
+{
+  uint32_t stop_condition_us = 4 * g_bus.half_bit_us;
+  uint32_t forward_end_us = g_bus.tx_done_us + stop_condition_us;
+
+  if (status == DALI_FRAME_ANSWER)
+  {
+    // The receive completes once the line has been idle for the RX idle
+    // threshold, so the backward frame itself ended that long ago.
+    uint32_t backward_end_us = g_bus.rx_done_us - DALI_BUS_RX_IDLE_US;
+    g_bus.next_frame_us = backward_end_us + DALI_SETTLE_BACKWARD_US;
+  }
+  else
+  {
+    g_bus.next_frame_us = forward_end_us + DALI_SETTLE_FORWARD_US;
+  }
+  g_bus.after_backward = (status == DALI_FRAME_ANSWER);
+
+  portENTER_CRITICAL(&g_stats_lock);
+  if (status == DALI_FRAME_ANSWER)
+  {
+    g_bus.stats.backward_frames++;
+  }
+  g_bus.stats.frames += frame_count;
+  g_bus.burst_frames += frame_count;
+  uint32_t burst_us = lsx_get_micro() - g_bus.burst_start_us;
+  if ((g_bus.burst_frames >= 2) && (burst_us > 0))
+  {
+    g_bus.stats.frames_per_second =
+      (uint32_t)(((uint64_t)g_bus.burst_frames * 1000000ULL) / burst_us);
+  }
+  portEXIT_CRITICAL(&g_stats_lock);
+}
+
+static void dali_bus_complete(dali_frame_t* frame)
+{
+  if (frame->callback)
+  {
+    frame->callback(frame, frame->user_data);
+  }
+  if (frame->notify_task)
+  {
+    xTaskNotify(frame->notify_task, dali_bus_notification_value(frame),
+                eSetValueWithOverwrite);
+  }
+}
+
+// Plain status and level queries to a short, group or broadcast address.
+// Their answers only depend on the gear, so two of them in a row get the same
+// answer. Special commands, DTR contents and extended queries depend on what
+// was sent right before them, which differs between callers.
+static bool dali_bus_coalescable(const dali_frame_t* frame)
+{
+  if (frame->script || ((frame->flags & DALI_FRAME_EXPECT_ANSWER) == 0) ||
+      (frame->bits != 16))
+  {
+    return false;
+  }
+  uint8_t address = (frame->data >> 8) & 0xFF;
+  uint8_t command = frame->data & 0xFF;
+  if (((address & 0x01) == 0) || ((address >= 0xA0) && (address < 0xFC)))
+  {
+    return false;
+  }
+  switch (command)
+  {
+    case 0x90: // QUERY STATUS
+    case 0x91: // QUERY CONTROL GEAR PRESENT
+    case 0x92: // QUERY LAMP FAILURE
+    case 0x93: // QUERY LAMP POWER ON
+    case 0x94: // QUERY LIMIT ERROR
+    case 0x95: // QUERY RESET STATE
+    case 0x96: // QUERY MISSING SHORT ADDRESS
+    case 0x97: // QUERY VERSION NUMBER
+    case 0x9A: // QUERY PHYSICAL MINIMUM
+    case 0x9B: // QUERY POWER FAILURE
+    case 0xA0: // QUERY ACTUAL LEVEL
+    case 0xA1: // QUERY MAX LEVEL
+    case 0xA2: // QUERY MIN LEVEL
+    case 0xA3: // QUERY POWER ON LEVEL
+    case 0xA4: // QUERY SYSTEM FAILURE LEVEL
+    case 0xA5: // QUERY FADE TIME/FADE RATE
+    {
+      return true;
+    }
+    default: break;
+  }
+  return false;
+}
+
+// Attaches a query to an identical one in flight and returns true, or starts
+// tracking it in a slot the frame then owns, so later ones can attach. A
+// query only waits for one of the same or a more urgent class, so coalescing
+// never delays it.
+static bool dali_bus_coalesce(dali_frame_t* frame)
+{
+  frame->inflight = 0;
+  if (!dali_bus_coalescable(frame))
+  {
+    return false;
+  }
+
+  bool attached = false;
+  int32_t unused = -1;
+  xSemaphoreTake(g_inflight_lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < array_size(g_inflight); ++i)
+  {
+    dali_bus_inflight_t* inflight = &g_inflight[i];
+    if (!inflight->used)
+    {
+      unused = (unused < 0) ? (int32_t)i : unused;
+      continue;
+    }
+    if ((inflight->data == frame->data) && (inflight->bits == frame->bits))
+    {
+      if ((inflight->bus_class <= frame->bus_class) &&
+          (inflight->waiter_count < DALI_BUS_INFLIGHT_WAITERS))
+      {
+        inflight->waiters[inflight->waiter_count++] = (*frame);
+        dali_bus_count(&g_bus.stats.coalesced_queries);
+        attached = true;
+      }
+      unused = -1;
+      break;
+    }
+  }
+  if (unused >= 0)
+  {
+    dali_bus_inflight_t* inflight = &g_inflight[unused];
+    inflight->data = frame->data;
+    inflight->bits = frame->bits;
+    inflight->bus_class = frame->bus_class;
+    inflight->waiter_count = 0;
+    inflight->used = true;
+    frame->inflight = (uint8_t)(unused + 1);
+  }
+  xSemaphoreGive(g_inflight_lock);
+  return attached;
+}
+
+// Hands the result of a finished query to everyone who attached to the slot
+// it owns, and frees the slot.
+static void dali_bus_complete_inflight(const dali_frame_t* frame)
+{
+  if (frame->script || (frame->inflight == 0))
+  {
+    return;
+  }
+
+  dali_frame_t waiters[DALI_BUS_INFLIGHT_WAITERS];
+  xSemaphoreTake(g_inflight_lock, portMAX_DELAY);
+  dali_bus_inflight_t* inflight = &g_inflight[frame->inflight - 1];
+  uint32_t waiter_count = inflight->waiter_count;
+  memcpy(waiters, inflight->waiters, waiter_count * sizeof(dali_frame_t));
+  inflight->used = false;
+  xSemaphoreGive(g_inflight_lock);
+
+  for (uint32_t i = 0; i < waiter_count; ++i)
+  {
+    waiters[i].status = frame->status;
+    waiters[i].response = frame->response;
+    dali_bus_complete(&waiters[i]);
+  }
+}
+
+// Compiles the ops from index on into one transaction, stopping in front of
+// a query or when the transaction is full, and returns the index to carry on
+// from. Waits between frames are folded into the encoded gaps. A wait at the
+// start is returned on its own, as is one after the last compiled frame, in
+// wait_us_out for the caller to add to the schedule.
+static uint32_t dali_bus_script_compile(const dali_script_t* script, uint32_t index,
+                                        dali_bus_transaction_t* transaction,
+                                        uint32_t* wait_us_out)
+{
+  uint32_t wait_us = 0;
+  for (; index < script->op_count; ++index)
+  {
+    const dali_op_t* op = &script->ops[index];
+    if (op->type == DALI_OP_WAIT)
+    {
+      wait_us += (uint32_t)op->wait_ms * 1000;
+      if (transaction->frame_count == 0)
+      {
+        index++;
+        break;
+      }
+      continue;
+    }
+    if ((op->type != DALI_OP_FRAME) && (op->type != DALI_OP_SEND_TWICE))
+    {
+      break;
+    }
+
+    uint32_t frame_count = (op->type == DALI_OP_SEND_TWICE) ? 2 : 1;
+    if ((transaction->frame_count + frame_count) > DALI_BUS_TRANSACTION_FRAMES)
+    {
+      break;
+    }
+
+    uint32_t data = dali_frame_16(op->address, op->command);
+    dali_bus_transaction_gap(transaction, DALI_SETTLE_FORWARD_US + wait_us);
+    dali_bus_transaction_add(transaction, data, 16);
+    if (op->type == DALI_OP_SEND_TWICE)
+    {
+      dali_bus_transaction_gap(transaction, DALI_SETTLE_SEND_TWICE_US);
+      dali_bus_transaction_add(transaction, data, 16);
+    }
+    wait_us = 0;
+  }
+  (*wait_us_out) = wait_us;
+  return index;
+}
+
+static void dali_bus_run_script_(dali_script_t* script, uint8_t priority)
+{
+  uint32_t start = lsx_get_micro();
+  script->transmissions = 0;
+  script->failed = 0;
+  script->query_count = 0;
+
+  uint32_t index = 0;
+  while (index < script->op_count)
+  {
+    const dali_op_t* op = &script->ops[index];
+    if (op->type == DALI_OP_QUERY)
+    {
+      dali_bus_transaction_t transaction = {};
+      dali_bus_transaction_add(&transaction, dali_frame_16(op->address, op->command), 16);
+      uint8_t response = 0;
+      dali_frame_status_t status = dali_bus_transmit_arbitrated(&transaction, priority);
+      if (status == DALI_FRAME_SENT)
+      {
+        status = dali_bus_read_response(DALI_BUS_ANSWER_TIMEOUT_MS, &response);
+        dali_bus_schedule_next(status, 1);
+      }
+      else
+      {
+        script->failed++;
+      }
+
+      if (script->query_count < DALI_SCRIPT_MAX_QUERIES)
+      {
+        script->status[script->query_count] = status;
+        script->response[script->query_count] = response;
+        script->query_count++;
+      }
+      script->transmissions++;
+      index++;
+      continue;
+    }
+
+    dali_bus_transaction_t transaction = {};
+    uint32_t wait_us = 0;
+    uint32_t next = dali_bus_script_compile(script, index, &transaction, &wait_us);
+    if (transaction.frame_count > 0)
+    {
+      if (dali_bus_transmit_arbitrated(&transaction, priority) == DALI_FRAME_SENT)
+      {
+        dali_bus_schedule_next(DALI_FRAME_SENT, transaction.frame_count);
+      }
+      else
+      {
+        script->failed++;
+      }
+      script->transmissions++;
+    }
+    g_bus.next_frame_us += wait_us;
+    // An op the compiler does not know is skipped rather than stalling.
+    index = (next == index) ? (index + 1) : next;
+  }
+
+  script->duration_us = lsx_get_micro() - start;
+}
+
+static void dali_bus_process(dali_frame_t* frame)
+{
+  if (frame->flags & DALI_FRAME_RECEIVED)
+  {
+    dali_bus_reception_t* reception = dali_bus_next_reception(0);
+    if (reception)
+    {
+      dali_bus_receive_event(reception);
+    }
+    return;
+  }
+
+  if (frame->script)
+  {
+    dali_bus_run_script_(frame->script, frame->priority);
+    frame->status = DALI_FRAME_SENT;
+    frame->response = 0;
+    dali_bus_complete(frame);
+    return;
+  }
+
+  // A send-twice pair and the idle gap between its frames go out as one
+  // transmission, so the repeat always lands inside the send-twice window.
+  dali_bus_transaction_t transaction = {};
+  dali_bus_transaction_add(&transaction, frame->data, frame->bits);
+  if (frame->flags & DALI_FRAME_SEND_TWICE)
+  {
+    dali_bus_transaction_gap(&transaction, DALI_SETTLE_SEND_TWICE_US);
+    dali_bus_transaction_add(&transaction, frame->data, frame->bits);
+  }
+  frame->status = dali_bus_transmit_arbitrated(&transaction, frame->priority);
+  frame->response = 0;
+  if (frame->status == DALI_FRAME_SENT)
+  {
+    if (frame->flags & DALI_FRAME_EXPECT_ANSWER)
+    {
+      frame->status =
+        dali_bus_read_response(DALI_BUS_ANSWER_TIMEOUT_MS, &frame->response);
+    }
+    dali_bus_schedule_next((dali_frame_status_t)frame->status, transaction.frame_count);
+  }
+
+  dali_bus_complete(frame);
+  dali_bus_complete_inflight(frame);
+}
+
+#if DALI_BENCHMARK
+static void dali_benchmark_bus_session(void)
+{
+  const uint32_t frame_count = 16;
+  const uint32_t frame_time_us = 17 * 2 * g_bus.half_bit_us;
+
+  // Old behaviour: the channel is powered up and down around every frame.
+  uint32_t start = lsx_get_micro();
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    rmt_enable(g_rmt_tx_channel);
+    dali_bus_transmit_(dali_frame_16(0xA1, 0), 16);
+    rmt_disable(g_rmt_tx_channel);
+  }
+  uint32_t toggled_us = (lsx_get_micro() - start) / frame_count;
+
+  dali_bus_begin();
+  start = lsx_get_micro();
+  for (uint32_t i = 0; i < frame_count; ++i)
+  {
+    dali_bus_begin();
+    dali_bus_transmit_(dali_frame_16(0xA1, 0), 16);
+    dali_bus_end();
+  }
+  uint32_t session_us = (lsx_get_micro() - start) / frame_count;
+  dali_bus_end();
+
+  lsx_log("Bus overhead per frame: %ld us toggled, %ld us in session\n",
+          (int32_t)(toggled_us - frame_time_us), (int32_t)(session_us - frame_time_us));
+}
+
+static void dali_rmt_append_bit(rmt_symbol_word_t* rmt_buffer, uint32_t index,
+                                uint8_t bit)
+{
+  rmt_symbol_word_t* current_symbol = rmt_buffer + index;
+  current_symbol->duration0 = g_bus.half_bit_us;
+  current_symbol->duration1 = g_bus.half_bit_us;
+  current_symbol->level0 = bit;
+  current_symbol->level1 = !bit;
+}
+
+static void dali_benchmark_encoder(void)
+{
+  const uint32_t iterations = 1000;
+  rmt_symbol_word_t symbols[1 + DALI_FRAME_MAX_BITS] = {};
+  volatile uint32_t sink = 0;
+
+  // Old path: a zeroed symbol array filled bit by bit.
+  uint32_t start = lsx_get_micro();
+  for (uint32_t n = 0; n < iterations; ++n)
+  {
+    rmt_symbol_word_t frame[32] = {};
+    uint32_t index = 0;
+    uint8_t address = (uint8_t)n;
+    uint8_t command = (uint8_t)(n >> 8);
+    dali_rmt_append_bit(frame, index++, 1);
+    for (int32_t i = 7; i >= 0; i--)
+      dali_rmt_append_bit(frame, index++, (address >> i) & 0x01);
+    for (int32_t i = 7; i >= 0; i--)
+      dali_rmt_append_bit(frame, index++, (command >> i) & 0x01);
+    sink += frame[index - 1].val;
+  }
+  uint32_t bitwise_ns = ((lsx_get_micro() - start) * 1000) / iterations;
+
+  const uint8_t frame_bits[] = { 16, 24, 32 };
+  for (uint32_t k = 0; k < array_size(frame_bits); ++k)
+  {
+    start = lsx_get_micro();
+    for (uint32_t n = 0; n < iterations; ++n)
+    {
+      dali_bus_transaction_t transaction = {};
+      dali_bus_transaction_add(&transaction, n * 0x9E3779B1, frame_bits[k]);
+      bool done = false;
+      size_t count = dali_bus_encode(&transaction, sizeof(transaction), 0,
+                                     array_size(symbols), symbols, &done, NULL);
+      sink += symbols[count - 1].val;
+    }
+    uint32_t table_ns = ((lsx_get_micro() - start) * 1000) / iterations;
+    lsx_log("Encode %u-bit frame: %lu ns table\n", frame_bits[k], table_ns);
+  }
+  lsx_log("Encode 16-bit frame: %lu ns bitwise (%lu)\n", bitwise_ns, sink & 1);
+}
+
+// Decodes encoder output, one half bit per level, the way a clean capture
+// would look to the receiver.
+static void dali_benchmark_decoder(void)
+{
+  const uint32_t iterations = 1000;
+  rmt_symbol_word_t symbols[1 + DALI_FRAME_MAX_BITS] = {};
+  volatile uint32_t sink = 0;
+
+  const uint8_t frame_bits[] = { 8, 16, 24 };
+  for (uint32_t k = 0; k < array_size(frame_bits); ++k)
+  {
+    dali_bus_transaction_t transaction = {};
+    dali_bus_transaction_add(&transaction, 0x9E3779B1, frame_bits[k]);
+    bool done = false;
+    size_t count = dali_bus_encode(&transaction, sizeof(transaction), 0,
+                                   array_size(symbols), symbols, &done, NULL);
+    dali_bus_reception_t reception = {};
+    memcpy(reception.symbols, symbols, count * sizeof(rmt_symbol_word_t));
+    reception.symbol_count = count;
+
+    uint32_t failures = 0;
+    uint32_t start = lsx_get_micro();
+    for (uint32_t n = 0; n < iterations; ++n)
+    {
+      dali_decoder_t decoder;
+      failures += (dali_bus_decode(&reception, g_bus.half_bit_us, &decoder) !=
+                   DALI_DECODE_FRAME);
+      sink += decoder.data;
+    }
+    uint32_t decode_ns = ((lsx_get_micro() - start) * 1000) / iterations;
+    lsx_log("Decode %u-bit frame: %lu ns, %lu failures (%lu)\n", frame_bits[k],
+            decode_ns, failures, sink & 1);
+  }
+}
+#endif
+
+static bool dali_bus_wants_listening(void)
+{
+  return (g_bus.event_callback != NULL) || g_bus.monitor;
+}
+
+// Listening needs the channels enabled while the bus is idle.
+static void dali_bus_update_listening(bool was_listening)
+{
+  bool listening = dali_bus_wants_listening();
+  if (listening && !was_listening)
+  {
+    dali_bus_begin();
+    // Wakes the bus task so it starts listening.
+    dali_frame_t wake = { .flags = DALI_FRAME_RECEIVED };
+    dali_bus_enqueue(&wake, 0);
+  }
+  else if (!listening && was_listening)
+  {
+    dali_bus_end();
+  }
+}
+
+// Takes the next frame from the most urgent class that has one. A frame is
+// always queued before pending is given, so a taken count means one is there.
+static bool dali_bus_next_frame(dali_frame_t* frame_out, TickType_t wait)
+{
+  if (xSemaphoreTake(g_bus.pending, wait) != pdTRUE)
+  {
+    return false;
+  }
+  for (uint32_t i = 0; i < DALI_CLASS_COUNT; ++i)
+  {
+    if (xQueueReceive(g_bus.frame_queues[i], frame_out, 0) == pdPASS)
+    {
+      if ((frame_out->flags & DALI_FRAME_RECEIVED) == 0)
+      {
+        uint32_t wait_us = lsx_get_micro() - frame_out->queued_us;
+        dali_bus_class_stats_t* stats = &g_bus.stats.classes[i];
+        portENTER_CRITICAL(&g_stats_lock);
+        stats->frames++;
+        stats->wait_max_us = max(stats->wait_max_us, wait_us);
+        g_bus.class_wait_total_us[i] += wait_us;
+        portEXIT_CRITICAL(&g_stats_lock);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static void dali_bus_task(void* parameters)
+{
+#if DALI_BENCHMARK
+  dali_benchmark_encoder();
+  dali_benchmark_decoder();
+  dali_benchmark_bus_session();
+#endif
+
+  dali_frame_t frame = {};
+  while (true)
+  {
+    // Listen while idle. A frame that completed after the last burst stopped
+    // listening is still in the receive queue and gets handled first.
+    if (dali_bus_wants_listening())
+    {
+      g_bus.listening = true;
+      frame.flags = DALI_FRAME_RECEIVED;
+      if (uxQueueMessagesWaiting(receive_queue) > 0)
+      {
+        g_bus.listening = false;
+        dali_bus_process(&frame);
+        continue;
+      }
+      dali_bus_arm_receive();
+    }
+    bool result = dali_bus_next_frame(&frame, portMAX_DELAY);
+    g_bus.listening = false;
+    if (!result)
+    {
+      continue;
+    }
+    if (frame.flags & DALI_FRAME_RECEIVED)
+    {
+      dali_bus_process(&frame);
+      continue;
+    }
+
+    // Hold the channels for as long as frames keep arriving back to back.
+    // Every frame is picked anew, so a more urgent class queued meanwhile
+    // goes next.
+    dali_bus_begin();
+    g_bus.burst_start_us = max(lsx_get_micro(), g_bus.next_frame_us);
+    g_bus.burst_frames = 0;
+    do
+    {
+      dali_bus_process(&frame);
+    } while (dali_bus_next_frame(&frame, 0));
+    dali_bus_end();
+  }
+}
+
+bool dali_bus_enqueue(const dali_frame_t* frame, uint32_t timeout_ms)
+{
+  if (!frame->script && ((frame->flags & DALI_FRAME_RECEIVED) == 0) &&
+      (frame->bits != 16) && (frame->bits != 24) && (frame->bits != 32))
+  {
+    return false;
+  }
+  dali_frame_t queued = (*frame);
+  queued.bus_class = min(queued.bus_class, DALI_CLASS_COUNT - 1);
+  queued.queued_us = lsx_get_micro();
+  if (dali_bus_coalesce(&queued))
+  {
+    return true;
+  }
+  TickType_t wait =
+    (timeout_ms == DALI_BUS_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+  if (xQueueSend(g_bus.frame_queues[queued.bus_class], &queued, wait) != pdPASS)
+  {
+    // Anyone who attached to its slot meanwhile gets the failure too.
+    queued.status = DALI_FRAME_FAILED;
+    queued.response = 0;
+    dali_bus_complete_inflight(&queued);
+    return false;
+  }
+  xSemaphoreGive(g_bus.pending);
+  return true;
+}
+
+// Class set by the calling task, DALI_CLASS_CONTROL if it never set one.
+static uint8_t dali_bus_task_class(void)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  for (uint32_t i = 0; i < DALI_BUS_CLASS_TASKS; ++i)
+  {
+    if (g_bus.class_tasks[i] == task)
+    {
+      return g_bus.task_classes[i];
+    }
+  }
+  return DALI_CLASS_CONTROL;
+}
+
+// Queues the frame and blocks until the bus task has finished with it.
+static dali_frame_status_t dali_bus_submit(dali_frame_t* frame, uint8_t* response_out)
+{
+  frame->notify_task = xTaskGetCurrentTaskHandle();
+  frame->bus_class = dali_bus_task_class();
+
+  xTaskNotifyStateClear(NULL);
+  if (!dali_bus_enqueue(frame, DALI_BUS_WAIT_FOREVER))
+  {
+    return DALI_FRAME_FAILED;
+  }
+
+  uint32_t value = 0;
+  xTaskNotifyWait(0, UINT32_MAX, &value, portMAX_DELAY);
+
+  if (response_out) (*response_out) = (uint8_t)(value & 0xFF);
+  return (dali_frame_status_t)((value >> 8) & 0xFF);
+}
+
+dali_frame_status_t dali_bus_transfer(uint32_t data, uint8_t bits, uint8_t flags,
+                                      uint8_t* response_out)
+{
+  dali_frame_t frame = {};
+  frame.data = data;
+  frame.bits = bits;
+  frame.flags = flags;
+  return dali_bus_submit(&frame, response_out);
+}
+
+dali_frame_status_t dali_bus_run_script(dali_script_t* script)
+{
+  dali_frame_t frame = {};
+  frame.script = script;
+  return dali_bus_submit(&frame, NULL);
+}
+
+dali_frame_status_t dali_bus_send(uint8_t address, uint8_t command)
+{
+  return dali_bus_transfer(dali_frame_16(address, command), 16, 0, NULL);
+}
+
+dali_frame_status_t dali_bus_send_twice(uint8_t address, uint8_t command)
+{
+  return dali_bus_transfer(dali_frame_16(address, command), 16, DALI_FRAME_SEND_TWICE,
+                           NULL);
+}
+
+dali_frame_status_t dali_bus_query(uint8_t address, uint8_t command,
+                                   uint8_t* response_out)
+{
+  return dali_bus_transfer(dali_frame_16(address, command), 16,
+                           DALI_FRAME_EXPECT_ANSWER, response_out);
+}
+
+void dali_bus_set_class(uint8_t bus_class)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  xSemaphoreTake(g_bus_lock, portMAX_DELAY);
+  int32_t index = -1;
+  for (uint32_t i = 0; i < DALI_BUS_CLASS_TASKS; ++i)
+  {
+    if (g_bus.class_tasks[i] == task)
+    {
+      index = i;
+      break;
+    }
+    if ((index < 0) && (g_bus.class_tasks[i] == NULL))
+    {
+      index = i;
+    }
+  }
+  if (index >= 0)
+  {
+    g_bus.class_tasks[index] = task;
+    g_bus.task_classes[index] = bus_class;
+  }
+  xSemaphoreGive(g_bus_lock);
+}
+
+void dali_bus_set_event_callback(dali_bus_event_callback_t callback, void* user_data)
+{
+  bool was_listening = dali_bus_wants_listening();
+  g_bus.event_user_data = user_data;
+  g_bus.event_callback = callback;
+  dali_bus_update_listening(was_listening);
+}
+
+void dali_bus_set_edge_interrupt(bool enabled)
+{
+  if (enabled && !g_bus.edge_interrupt)
+  {
+    lsx_gpio_install_interrupt_service();
+    lsx_gpio_add_pin_interrput(DALI_RX, dali_bus_rx_edge, NULL);
+  }
+  else if (!enabled && g_bus.edge_interrupt)
+  {
+    lsx_gpio_remove_pin_interrput(DALI_RX);
+  }
+  g_bus.edge_interrupt = enabled;
+}
+
+void dali_bus_set_monitor(bool enabled)
+{
+  bool was_listening = dali_bus_wants_listening();
+  g_bus.monitor = enabled;
+  dali_bus_update_listening(was_listening);
+}
+
+uint32_t dali_bus_read_captures(dali_capture_t* captures_out, uint32_t capacity)
+{
+  uint32_t tail = g_capture_tail;
+  uint32_t head = __atomic_load_n(&g_capture_head, __ATOMIC_ACQUIRE);
+  uint32_t count = min(head - tail, capacity);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    captures_out[i] = g_captures[(tail + i) % DALI_BUS_CAPTURE_COUNT];
+  }
+  __atomic_store_n(&g_capture_tail, tail + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+void dali_bus_get_stats(dali_bus_stats_t* stats_out)
+{
+  uint64_t wait_total_us[DALI_CLASS_COUNT];
+  portENTER_CRITICAL(&g_stats_lock);
+  (*stats_out) = g_bus.stats;
+  memcpy(wait_total_us, g_bus.class_wait_total_us, sizeof(wait_total_us));
+  portEXIT_CRITICAL(&g_stats_lock);
+  for (uint32_t i = 0; i < DALI_CLASS_COUNT; ++i)
+  {
+    dali_bus_class_stats_t* stats = &stats_out->classes[i];
+    stats->wait_mean_us = (uint32_t)(wait_total_us[i] / max(stats->frames, 1));
+  }
+}
+
+void dali_bus_initialize(uint32_t half_bit_us)
+{
+  g_bus.half_bit_us = half_bit_us;
+  g_bus.references = 0;
+  g_bus.enabled = false;
+  if (g_bus.idle_timeout_ms == 0)
+  {
+    g_bus.idle_timeout_ms = DALI_BUS_IDLE_TIMEOUT_MS;
+  }
+  g_bus.next_frame_us = lsx_get_micro();
+  g_bus.backward_half_bit_q4 = half_bit_us * 16;
+  g_bus.stats.backward_half_bit_us = half_bit_us;
+
+  dali_bus_build_manchester_table(half_bit_us);
+  dali_bus_initialize_rmt();
+
+  g_bus_lock = xSemaphoreCreateMutex();
+  g_inflight_lock = xSemaphoreCreateMutex();
+  g_bus_idle_timer = lsx_timer_create(dali_bus_idle_callback, NULL);
+  g_bus_settle_timer = lsx_timer_create(dali_bus_settle_callback, NULL);
+
+  for (uint32_t i = 0; i < DALI_CLASS_COUNT; ++i)
+  {
+    g_bus.frame_queues[i] = xQueueCreate(DALI_BUS_QUEUE_COUNT, sizeof(dali_frame_t));
+  }
+  g_bus.pending = xSemaphoreCreateCounting(DALI_CLASS_COUNT * DALI_BUS_QUEUE_COUNT, 0);
+
+  g_bus.task = xTaskCreateStatic(dali_bus_task, "DALI Bus Task", DALI_BUS_STACK_SIZE,
+                                 NULL, 4, dali_bus_stack, &dali_bus_stack_type);
+
+  dali_bus_set_edge_interrupt(true);
+}
@@ -0,0 +1,272 @@
+#ifndef DALI_BUS_H
+#define DALI_BUS_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define DALI_BUS_HALF_BIT_US (833 / 2)
+
+#define DALI_FRAME_MAX_BITS 32
+
+#define DALI_SCRIPT_MAX_QUERIES 8
+
+// Bus and commissioning benchmarks run at the start of the DALI task. Set to 1
+// here or with -DDALI_BENCHMARK=1.
+#ifndef DALI_BENCHMARK
+#define DALI_BENCHMARK 0
+#endif
+
+#define dali_frame_16(address, command) ((((uint32_t)(address)) << 8) | (command))
+#define dali_frame_24(address, instance, opcode)                                  \
+  ((((uint32_t)(address)) << 16) | (((uint32_t)(instance)) << 8) | (opcode))
+
+typedef enum dali_frame_flag_t
+{
+  DALI_FRAME_EXPECT_ANSWER = 0x01,
+  DALI_FRAME_SEND_TWICE = 0x02,
+} dali_frame_flag_t;
+
+typedef enum dali_frame_status_t
+{
+  DALI_FRAME_PENDING = 0,
+  DALI_FRAME_SENT,
+  DALI_FRAME_ANSWER,
+  DALI_FRAME_NO_ANSWER,
+  DALI_FRAME_INVALID,
+  DALI_FRAME_FAILED,
+  DALI_FRAME_COLLISION,
+} dali_frame_status_t;
+
+// IEC 62386-101 multi-master priorities, each with its own settling window.
+// 0 in a frame means DALI_PRIORITY_USER.
+typedef enum dali_priority_t
+{
+  DALI_PRIORITY_TRANSACTION = 1,
+  DALI_PRIORITY_USER,
+  DALI_PRIORITY_CONFIGURATION,
+  DALI_PRIORITY_AUTOMATIC,
+  DALI_PRIORITY_PERIODIC,
+} dali_priority_t;
+
+// Scheduling classes of the bus task, most urgent first. The bus task always
+// takes the next queued frame or script from the most urgent class that has
+// one, so control traffic only waits for the frame or script on the bus.
+// 0 in a frame means DALI_CLASS_CONTROL.
+typedef enum dali_bus_class_t
+{
+  DALI_CLASS_CONTROL = 0,
+  DALI_CLASS_CONFIGURATION,
+  DALI_CLASS_POLLING,
+  DALI_CLASS_COMMISSIONING,
+  DALI_CLASS_COUNT,
+} dali_bus_class_t;
+
+// Time from dali_bus_enqueue() until the bus task takes the frame up.
+typedef struct dali_bus_class_stats_t
+{
+  uint32_t frames;
+  uint32_t wait_mean_us;
+  uint32_t wait_max_us;
+} dali_bus_class_stats_t;
+
+typedef struct dali_bus_stats_t
+{
+  uint32_t frames;
+  uint32_t backward_frames;
+  uint32_t frames_per_second;
+  uint32_t collisions;
+  uint32_t collision_failures;
+  uint32_t busy_deferrals;
+  uint32_t decode_failures;
+  uint32_t backward_collisions;
+  uint32_t backward_half_bit_us;
+  uint32_t events;
+  uint32_t captures_dropped;
+  uint32_t receive_overruns;
+  uint32_t coalesced_queries;
+  dali_bus_class_stats_t classes[DALI_CLASS_COUNT];
+} dali_bus_stats_t;
+
+typedef enum dali_capture_type_t
+{
+  DALI_CAPTURE_FORWARD = 0,
+  DALI_CAPTURE_BACKWARD,
+  DALI_CAPTURE_ERROR,
+  DALI_CAPTURE_COLLISION,
+} dali_capture_type_t;
+
+// Set in dali_capture_t.type on the echo of a frame this controller sent.
+#define DALI_CAPTURE_OWN 0x80
+
+// One frame seen on the line. time_us is the first edge and duration_us runs
+// to the last edge; data and bits are only set if the frame decoded.
+typedef struct dali_capture_t
+{
+  uint32_t time_us;
+  uint32_t data;
+  uint16_t duration_us;
+  uint8_t bits;
+  uint8_t type;
+} dali_capture_t;
+
+// Captures the monitor ring holds.
+#define DALI_BUS_CAPTURE_COUNT 512
+
+typedef enum dali_op_type_t
+{
+  DALI_OP_FRAME = 0,
+  DALI_OP_SEND_TWICE,
+  DALI_OP_QUERY,
+  DALI_OP_WAIT,
+} dali_op_type_t;
+
+// One step of a bus script. DALI_OP_WAIT adds wait_ms of idle time on top of
+// the normal settling time before the next frame.
+typedef struct dali_op_t
+{
+  uint8_t type;
+  uint8_t address;
+  uint8_t command;
+  uint16_t wait_ms;
+} dali_op_t;
+
+#define dali_op_frame(address, command) { DALI_OP_FRAME, (address), (command), 0 }
+#define dali_op_twice(address, command) { DALI_OP_SEND_TWICE, (address), (command), 0 }
+#define dali_op_query(address, command) { DALI_OP_QUERY, (address), (command), 0 }
+#define dali_op_wait(ms)                { DALI_OP_WAIT, 0, 0, (ms) }
+
+// A fixed sequence of operations run by the bus task without interleaving
+// other frames. Consecutive forward frames are sent as one RMT transmission,
+// only queries break the batch. The ops are never modified, so a script can
+// be run again as is; the rest is filled in on every run.
+typedef struct dali_script_t
+{
+  const dali_op_t* ops;
+  uint32_t op_count;
+
+  uint32_t duration_us;
+  uint32_t transmissions;
+  uint32_t failed; // Transmissions that did not get onto the bus.
+  uint32_t query_count;
+  uint8_t status[DALI_SCRIPT_MAX_QUERIES];
+  uint8_t response[DALI_SCRIPT_MAX_QUERIES];
+} dali_script_t;
+
+typedef struct dali_frame_t dali_frame_t;
+
+typedef void (*dali_bus_event_callback_t)(uint32_t data, uint8_t bits, void* user_data);
+
+typedef void (*dali_frame_callback_t)(const dali_frame_t* frame, void* user_data);
+
+struct dali_frame_t
+{
+  uint32_t data;
+  uint8_t bits;
+  uint8_t flags;
+
+  uint8_t priority;
+  uint8_t bus_class;
+
+  uint8_t status;
+  uint8_t response;
+
+  TaskHandle_t notify_task;
+  dali_frame_callback_t callback;
+  void* user_data;
+
+  // When set the frame is a whole script and data/bits are ignored.
+  dali_script_t* script;
+
+  // Set by dali_bus_enqueue().
+  uint32_t queued_us;
+  uint8_t inflight; // Coalescing slot + 1 the frame owns, 0 for none.
+};
+
+void dali_bus_initialize(uint32_t half_bit_us);
+
+void dali_bus_begin(void);
+void dali_bus_end(void);
+void dali_bus_set_idle_timeout(uint32_t timeout_ms);
+
+/**
+ * Queues a forward frame for the bus task and returns without waiting.
+ *
+ * When the frame has been sent (and its backward frame received, if
+ * DALI_FRAME_EXPECT_ANSWER is set) the bus task calls frame->callback and/or
+ * notifies frame->notify_task with dali_bus_notification_value().
+ *
+ * A plain status or level query (QUERY STATUS to QUERY POWER FAILURE, except
+ * QUERY CONTENT DTR0 and QUERY DEVICE TYPE, and QUERY ACTUAL LEVEL to QUERY
+ * FADE TIME/FADE RATE) to a short, group or broadcast address, identical to
+ * one already queued or on the bus, is not sent again; it completes with the
+ * answer to the earlier one. Special commands such as COMPARE, QUERY SHORT
+ * ADDRESS and VERIFY SHORT ADDRESS, the DTR content queries and extended
+ * queries after ENABLE DEVICE TYPE always go on the bus, since their answer
+ * depends on frames the caller sent before.
+ */
+bool dali_bus_enqueue(const dali_frame_t* frame, uint32_t timeout_ms);
+
+// timeout_ms for dali_bus_enqueue() that waits for queue space however long.
+#define DALI_BUS_WAIT_FOREVER UINT32_MAX
+
+/**
+ * Scheduling class of the blocking calls below made by the calling task.
+ * Long runs such as commissioning set their class for the duration, so
+ * control frames from other tasks and callbacks get ahead of them at every
+ * frame boundary.
+ */
+void dali_bus_set_class(uint8_t bus_class);
+
+dali_frame_status_t dali_bus_transfer(uint32_t data, uint8_t bits, uint8_t flags,
+                                      uint8_t* response_out);
+dali_frame_status_t dali_bus_send(uint8_t address, uint8_t command);
+dali_frame_status_t dali_bus_send_twice(uint8_t address, uint8_t command);
+dali_frame_status_t dali_bus_query(uint8_t address, uint8_t command,
+                                   uint8_t* response_out);
+
+/**
+ * Runs a script on the bus task and waits for it to finish. Returns
+ * DALI_FRAME_SENT, or DALI_FRAME_FAILED if the script could not be queued.
+ * Query results are in script->status and script->response, in op order.
+ */
+dali_frame_status_t dali_bus_run_script(dali_script_t* script);
+
+/**
+ * Keeps the receiver listening whenever the bus is idle and calls callback on
+ * the bus task for every 16 or 24-bit forward frame sent by another master,
+ * such as IEC 62386-103 input device events. The callback must not wait for
+ * the bus, frames it sends have to go through dali_bus_enqueue(). Pass NULL
+ * to stop listening.
+ */
+void dali_bus_set_event_callback(dali_bus_event_callback_t callback, void* user_data);
+
+/**
+ * The bus keeps an edge interrupt on the receive pin to tell a backward frame
+ * in progress from silence, so a query without an answer returns as soon as
+ * the backward frame window closes. It is enabled by dali_bus_initialize();
+ * with it off, a missing answer waits out the longest possible frame.
+ */
+void dali_bus_set_edge_interrupt(bool enabled);
+
+/**
+ * Monitor mode: while enabled every reception, own echoes included, is
+ * decoded on the bus task and stored in a fixed-size ring. The bus listens
+ * whenever idle so nothing is missed between transfers.
+ */
+void dali_bus_set_monitor(bool enabled);
+
+/**
+ * Moves up to capacity captures out of the ring, oldest first. Safe to call
+ * from one task at a time while the ring is being filled.
+ */
+uint32_t dali_bus_read_captures(dali_capture_t* captures_out, uint32_t capacity);
+
+void dali_bus_get_stats(dali_bus_stats_t* stats_out);
+
+static inline uint32_t dali_bus_notification_value(const dali_frame_t* frame)
+{
+  return ((uint32_t)frame->status << 8) | frame->response;
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "dali_decode.h"
+
+// IEC 62386-101 lets a sender's half bits run from 333 to 500 us, +-20% of
+// the nominal 416.7 us. The windows are taken around the calibrated estimate
+// of this bus, which may sit anywhere in that range itself, so a half bit
+// from another device can be up to 30% off it: 500 us against an estimate
+// of 385 us, or 333 us against 476 us.
+#define DALI_DECODE_TOLERANCE_PERCENT 30
+
+void dali_decoder_begin(dali_decoder_t* decoder, uint32_t half_bit_us)
+{
+  (*decoder) = (dali_decoder_t){};
+  decoder->half_bit_us = half_bit_us;
+  decoder->half_min_us = (half_bit_us * (100 - DALI_DECODE_TOLERANCE_PERCENT)) / 100;
+  decoder->half_max_us = (half_bit_us * (100 + DALI_DECODE_TOLERANCE_PERCENT)) / 100;
+  decoder->bit_min_us = 2 * decoder->half_min_us + (half_bit_us / 10);
+  decoder->bit_max_us = 2 * decoder->half_max_us - (half_bit_us / 10);
+  decoder->result = DALI_DECODE_SILENCE;
+}
+
+static void dali_decoder_fail(dali_decoder_t* decoder, dali_decode_result_t result)
+{
+  if (decoder->result != DALI_DECODE_COLLISION)
+  {
+    decoder->result = result;
+  }
+}
+
+static bool dali_decoder_failed(const dali_decoder_t* decoder)
+{
+  return (decoder->result == DALI_DECODE_FRAMING_ERROR) ||
+         (decoder->result == DALI_DECODE_COLLISION);
+}
+
+static void dali_decoder_half(dali_decoder_t* decoder, uint8_t level)
+{
+  uint32_t index = decoder->halves++;
+  if (index < 2)
+  {
+    // Start bit: active then idle.
+    if (level != ((index == 0) ? 1 : 0))
+    {
+      dali_decoder_fail(decoder, DALI_DECODE_FRAMING_ERROR);
+    }
+    return;
+  }
+
+  if ((index & 0x01) == 0)
+  {
+    decoder->first_half = level;
+    return;
+  }
+  if ((level == decoder->first_half) || (decoder->bits >= 32))
+  {
+    dali_decoder_fail(decoder, DALI_DECODE_FRAMING_ERROR);
+    return;
+  }
+  decoder->data = (decoder->data << 1) | decoder->first_half;
+  decoder->bits++;
+}
+
+static void dali_decoder_run(dali_decoder_t* decoder, uint8_t level, uint32_t duration_us)
+{
+  if (dali_decoder_failed(decoder))
+  {
+    return;
+  }
+  if (decoder->halves == 0)
+  {
+    // Idle before the start bit is not part of the frame.
+    if (level == 0)
+    {
+      return;
+    }
+    decoder->result = DALI_DECODE_FRAME;
+  }
+  if (decoder->stopped)
+  {
+    // Anything active after the stop condition is a second frame.
+    dali_decoder_fail(decoder, DALI_DECODE_FRAMING_ERROR);
+    return;
+  }
+
+  uint32_t units = 0;
+  if ((duration_us >= decoder->half_min_us) && (duration_us <= decoder->half_max_us))
+  {
+    units = 1;
+  }
+  else if ((duration_us >= decoder->bit_min_us) && (duration_us <= decoder->bit_max_us))
+  {
+    units = 2;
+  }
+  else if ((level == 0) && (duration_us > decoder->bit_max_us))
+  {
+    // Stop condition. It may start with the idle half of a final 1 bit.
+    if (decoder->halves & 0x01)
+    {
+      dali_decoder_half(decoder, 0);
+    }
+    decoder->stopped = true;
+    return;
+  }
+  else
+  {
+    dali_decoder_fail(decoder, DALI_DECODE_COLLISION);
+    return;
+  }
+
+  decoder->measured_us += duration_us;
+  decoder->measured_halves += units;
+  while (units--)
+  {
+    dali_decoder_half(decoder, level);
+  }
+}
+
+void dali_decoder_push(dali_decoder_t* decoder, uint8_t level, uint32_t duration_us)
+{
+  if (duration_us == 0)
+  {
+    return;
+  }
+  if ((decoder->pending_us > 0) && (level != decoder->pending_level))
+  {
+    dali_decoder_run(decoder, decoder->pending_level, decoder->pending_us);
+    decoder->pending_us = 0;
+  }
+  decoder->pending_level = level;
+  decoder->pending_us += duration_us;
+}
+
+dali_decode_result_t dali_decoder_end(dali_decoder_t* decoder)
+{
+  if (decoder->pending_us > 0)
+  {
+    dali_decoder_run(decoder, decoder->pending_level, decoder->pending_us);
+    decoder->pending_us = 0;
+  }
+  // The receiver only stops once the line has been idle for longer than any
+  // level in a frame, which is the stop condition.
+  if ((decoder->halves > 0) && !decoder->stopped)
+  {
+    dali_decoder_run(decoder, 0, decoder->bit_max_us + 1);
+  }
+
+  if ((decoder->result == DALI_DECODE_FRAME) &&
+      ((decoder->bits == 0) || ((decoder->bits % 8) != 0) || (decoder->halves & 0x01)))
+  {
+    decoder->result = DALI_DECODE_FRAMING_ERROR;
+  }
+  if (decoder->result != DALI_DECODE_FRAME)
+  {
+    decoder->data = 0;
+    decoder->bits = 0;
+  }
+  return (dali_decode_result_t)decoder->result;
+}
@@ -0,0 +1,62 @@
+#ifndef DALI_DECODE_H
+#define DALI_DECODE_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Streaming Manchester decoder for DALI frames. It is fed the line as runs of
+// one level, e.g. the halves of RMT symbols, and checks the start bit, every
+// mid-bit transition and the stop condition in a single pass. It depends on
+// nothing but the C library so it also builds for the host.
+//
+// Levels are 1 for an active (low) bus and 0 for idle, as the receiver sees
+// them.
+
+typedef enum dali_decode_result_t
+{
+  DALI_DECODE_SILENCE = 0,   // Nothing on the line.
+  DALI_DECODE_FRAME,         // Clean frame in data and bits.
+  DALI_DECODE_FRAMING_ERROR, // Bit timing fine but no valid frame.
+  DALI_DECODE_COLLISION,     // A level that is neither a half nor a whole bit.
+} dali_decode_result_t;
+
+typedef struct dali_decoder_t
+{
+  uint32_t half_bit_us;
+  uint32_t half_min_us;
+  uint32_t half_max_us;
+  uint32_t bit_min_us;
+  uint32_t bit_max_us;
+
+  uint8_t pending_level;
+  uint32_t pending_us;
+
+  uint32_t halves;
+  uint8_t first_half;
+  bool stopped;
+  uint8_t result;
+
+  uint32_t data;
+  uint8_t bits;
+
+  uint32_t measured_us;
+  uint32_t measured_halves;
+} dali_decoder_t;
+
+void dali_decoder_begin(dali_decoder_t* decoder, uint32_t half_bit_us);
+
+// Runs of the same level in a row are merged, zero durations are ignored.
+void dali_decoder_push(dali_decoder_t* decoder, uint8_t level, uint32_t duration_us);
+
+dali_decode_result_t dali_decoder_end(dali_decoder_t* decoder);
+
+// Average half bit over the levels of the frame, 0 if nothing was measured.
+static inline uint32_t dali_decoder_half_bit_us(const dali_decoder_t* decoder)
+{
+  if (decoder->measured_halves == 0)
+  {
+    return 0;
+  }
+  return decoder->measured_us / decoder->measured_halves;
+}
+
+#endif
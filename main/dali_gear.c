@@ -0,0 +1,527 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "dali_gear.h"
+#include "dali.h"
+#include "util.h"
+#include "platform.h"
+
+// QUERY STATUS bit 4.
+#define DALI_STATUS_FADE_RUNNING 0x10
+
+#define DALI_MASK 0xFF
+
+static dali_gear_t g_gears[DALI_GEAR_COUNT] = {};
+static SemaphoreHandle_t g_gear_lock;
+
+// Last value sent to DTR0, -1 if unknown, for the SET commands that store it.
+static int16_t g_dtr0 = -1;
+
+static uint8_t g_next_gear = 0;
+
+// Missed answers are counted up to here.
+#define DALI_GEAR_MISSED_MAX 255
+
+// DT6 extended queries in a row without an answer before the gear is taken
+// for other than LED gear. One lost backward frame is not enough.
+#define DALI_GEAR_NOT_LED_MISSES 3
+
+static inline void dali_gear_lock(void)
+{
+  xSemaphoreTake(g_gear_lock, portMAX_DELAY);
+}
+
+static inline void dali_gear_unlock(void)
+{
+  xSemaphoreGive(g_gear_lock);
+}
+
+static inline bool dali_is_special(uint8_t address)
+{
+  return (address >= DALI_SPECIAL_FIRST) && (address <= DALI_SPECIAL_LAST);
+}
+
+// Commands to a group may or may not reach a gear, group membership is not
+// modelled, so whatever they would change becomes unknown instead.
+static bool dali_gear_reaches(uint8_t address, uint32_t index, bool* certain_out)
+{
+  if ((g_gears[index].flags & DALI_GEAR_PRESENT) == 0)
+  {
+    return false;
+  }
+  if ((address & 0x80) == 0)
+  {
+    (*certain_out) = true;
+    return (address >> 1) == index;
+  }
+  (*certain_out) = (address >= DALI_BROADCAST_DP);
+  return true;
+}
+
+static void dali_gear_forget(dali_gear_t* gear)
+{
+  gear->flags &= DALI_GEAR_PRESENT | DALI_GEAR_PHYSICAL_MIN_KNOWN | DALI_GEAR_NOT_LED;
+}
+
+static void dali_gear_target(dali_gear_t* gear, uint8_t level, bool fade, bool certain)
+{
+  if (!certain)
+  {
+    gear->flags &= ~(DALI_GEAR_TARGET_KNOWN | DALI_GEAR_CONFIRMED);
+    return;
+  }
+  // The gear clamps any level but off into its own range.
+  if ((level != 0) && (gear->flags & DALI_GEAR_MIN_KNOWN))
+  {
+    level = max(level, gear->min_level);
+  }
+  if ((level != 0) && (gear->flags & DALI_GEAR_MAX_KNOWN))
+  {
+    level = min(level, gear->max_level);
+  }
+  gear->target_level = level;
+  gear->target_ms = lsx_get_millis();
+  gear->flags |= DALI_GEAR_TARGET_KNOWN;
+
+  bool settled = (gear->flags & DALI_GEAR_CONFIRMED) && (gear->actual_level == level);
+  if (fade && !settled)
+  {
+    gear->flags |= DALI_GEAR_FADING;
+  }
+  else
+  {
+    gear->flags &= ~DALI_GEAR_FADING;
+  }
+}
+
+// SET MIN LEVEL and SET MAX LEVEL store DTR0, clamped by the gear: MIN LEVEL
+// into PHYSICAL MINIMUM to MAX LEVEL, MAX LEVEL into MIN LEVEL to 254. Where
+// a bound it clamps against is unknown, so is the result, and the poller
+// reads it back.
+static void dali_gear_limit(dali_gear_t* gear, uint8_t command, bool certain)
+{
+  bool set_min = command == DALI_SET_MIN_LEVEL;
+  uint16_t known = set_min ? DALI_GEAR_MIN_KNOWN : DALI_GEAR_MAX_KNOWN;
+  gear->flags &= ~known;
+  if (!certain || (g_dtr0 < 0))
+  {
+    return;
+  }
+
+  uint8_t level = (uint8_t)g_dtr0;
+  if (set_min)
+  {
+    if ((gear->flags & DALI_GEAR_PHYSICAL_MIN_KNOWN) == 0)
+    {
+      return;
+    }
+    level = max(level, gear->physical_min);
+    if (gear->flags & DALI_GEAR_MAX_KNOWN)
+    {
+      level = min(level, gear->max_level);
+    }
+    else if (level > gear->physical_min)
+    {
+      return;
+    }
+    gear->min_level = level;
+  }
+  else
+  {
+    level = min(level, 254);
+    if (gear->flags & DALI_GEAR_MIN_KNOWN)
+    {
+      level = max(level, gear->min_level);
+    }
+    else if (level < 254)
+    {
+      return;
+    }
+    gear->max_level = level;
+  }
+  gear->flags |= known;
+  if (gear->flags & DALI_GEAR_TARGET_KNOWN)
+  {
+    dali_gear_target(gear, gear->target_level, false, true);
+  }
+}
+
+static void dali_gear_command(dali_gear_t* gear, uint8_t command, bool certain)
+{
+  switch (command)
+  {
+    case DALI_OFF:
+    {
+      dali_gear_target(gear, 0, false, certain);
+      break;
+    }
+    case DALI_ON:
+    {
+      // RECALL MAX LEVEL
+      dali_gear_target(gear, gear->max_level, false,
+                       certain && (gear->flags & DALI_GEAR_MAX_KNOWN));
+      break;
+    }
+    case DALI_RECALL_MIN_LEVEL:
+    {
+      dali_gear_target(gear, gear->min_level, false,
+                       certain && (gear->flags & DALI_GEAR_MIN_KNOWN));
+      break;
+    }
+    case DALI_RESET:
+    {
+      dali_gear_forget(gear);
+      break;
+    }
+    case DALI_SET_MAX_LEVEL:
+    {
+      dali_gear_limit(gear, command, certain);
+      break;
+    }
+    case DALI_SET_MIN_LEVEL:
+    {
+      dali_gear_limit(gear, command, certain);
+      break;
+    }
+    default:
+    {
+      // Steps, scenes and the other level commands end up somewhere the
+      // model cannot tell.
+      if (command < DALI_RESET)
+      {
+        dali_gear_target(gear, 0, false, false);
+      }
+      break;
+    }
+  }
+}
+
+void dali_gear_sent(uint8_t address, uint8_t command)
+{
+  dali_gear_lock();
+  if (dali_is_special(address))
+  {
+    if (address == DALI_SET_DTR0)
+    {
+      g_dtr0 = command;
+    }
+    else if (address == DALI_PROGRAM_SHORT_ADDRESS)
+    {
+      // Whatever was known may now belong to another address.
+      for (uint32_t i = 0; i < array_size(g_gears); ++i)
+      {
+        g_gears[i].flags &= DALI_GEAR_PRESENT;
+      }
+    }
+    dali_gear_unlock();
+    return;
+  }
+
+  for (uint32_t i = 0; i < array_size(g_gears); ++i)
+  {
+    bool certain = false;
+    if (!dali_gear_reaches(address, i, &certain))
+    {
+      continue;
+    }
+    dali_gear_t* gear = &g_gears[i];
+    if ((address & 0x01) == 0)
+    {
+      // Direct arc power, MASK leaves the level alone.
+      if (command != DALI_MASK)
+      {
+        dali_gear_target(gear, command, true, certain);
+      }
+    }
+    else if (command == DALI_SET_SHORT_ADDRESS)
+    {
+      gear->flags &= DALI_GEAR_PRESENT;
+    }
+    else
+    {
+      dali_gear_command(gear, command, certain);
+    }
+  }
+  dali_gear_unlock();
+}
+
+// The gear a query was put to, -1 if it cannot be told. A broadcast answer
+// can only be put down to a gear if it is the only one.
+static int32_t dali_gear_queried(uint8_t address)
+{
+  if (dali_is_special(address) || ((address & 0x01) == 0))
+  {
+    return -1;
+  }
+  if ((address & 0x80) == 0)
+  {
+    return address >> 1;
+  }
+  int32_t index = -1;
+  if (address >= DALI_BROADCAST_DP)
+  {
+    for (uint32_t i = 0; i < array_size(g_gears); ++i)
+    {
+      if (g_gears[i].flags & DALI_GEAR_PRESENT)
+      {
+        if (index >= 0)
+        {
+          return -1;
+        }
+        index = (int32_t)i;
+      }
+    }
+  }
+  return index;
+}
+
+void dali_gear_answered(uint8_t address, uint8_t command, uint8_t response)
+{
+  dali_gear_lock();
+  int32_t index = dali_gear_queried(address);
+  if (index < 0)
+  {
+    dali_gear_unlock();
+    return;
+  }
+
+  dali_gear_t* gear = &g_gears[index];
+  gear->last_seen_ms = lsx_get_millis();
+  gear->missed = 0;
+  switch (command)
+  {
+    case DALI_QUERY_ACTUAL_OUTPUT:
+    {
+      if (response == DALI_MASK)
+      {
+        break;
+      }
+      gear->actual_level = response;
+      gear->confirmed_ms = lsx_get_millis();
+      gear->flags |= DALI_GEAR_CONFIRMED;
+      if ((gear->flags & DALI_GEAR_TARGET_KNOWN) == 0)
+      {
+        gear->target_level = response;
+        gear->target_ms = gear->confirmed_ms;
+        gear->flags |= DALI_GEAR_TARGET_KNOWN;
+      }
+      if (response == gear->target_level)
+      {
+        gear->flags &= ~DALI_GEAR_FADING;
+      }
+      break;
+    }
+    case DALI_QUERY_STATUS:
+    {
+      gear->status = response;
+      gear->flags |= DALI_GEAR_STATUS_KNOWN;
+      if (response & DALI_STATUS_FADE_RUNNING)
+      {
+        gear->flags |= DALI_GEAR_FADING;
+      }
+      else
+      {
+        gear->flags &= ~DALI_GEAR_FADING;
+      }
+      break;
+    }
+    case DALI_QUERY_MIN_LEVEL:
+    {
+      gear->min_level = response;
+      gear->flags |= DALI_GEAR_MIN_KNOWN;
+      break;
+    }
+    case DALI_QUERY_MAX_LEVEL:
+    {
+      gear->max_level = response;
+      gear->flags |= DALI_GEAR_MAX_KNOWN;
+      break;
+    }
+    case DALI_QUERY_PHYSICAL_MINIMUM:
+    {
+      gear->physical_min = response;
+      gear->flags |= DALI_GEAR_PHYSICAL_MIN_KNOWN;
+      break;
+    }
+    case DALI_EX_QUERY_FAILURE_STATUS:
+    {
+      gear->failure_status = response;
+      gear->flags |= DALI_GEAR_FAILURE_KNOWN;
+      gear->flags &= ~DALI_GEAR_NOT_LED;
+      gear->ex_missed = 0;
+      break;
+    }
+    default: break;
+  }
+  dali_gear_unlock();
+}
+
+// Silence to extended queries, several in a row from gear that answers
+// everything else, means the gear is not LED gear; to any other query the
+// gear did not hear it or is gone.
+void dali_gear_missed(uint8_t address, uint8_t command)
+{
+  dali_gear_lock();
+  int32_t index = dali_gear_queried(address);
+  if (index >= 0)
+  {
+    dali_gear_t* gear = &g_gears[index];
+    if (command >= DALI_EX_FIRST)
+    {
+      if ((gear->missed == 0) && ((++gear->ex_missed) >= DALI_GEAR_NOT_LED_MISSES))
+      {
+        gear->flags |= DALI_GEAR_NOT_LED;
+      }
+    }
+    else if (gear->missed < DALI_GEAR_MISSED_MAX)
+    {
+      gear->missed++;
+    }
+  }
+  dali_gear_unlock();
+}
+
+bool dali_gear_get(uint8_t short_address, dali_gear_t* gear_out)
+{
+  if (short_address >= DALI_GEAR_COUNT)
+  {
+    return false;
+  }
+  dali_gear_lock();
+  (*gear_out) = g_gears[short_address];
+  dali_gear_unlock();
+  return (gear_out->flags & DALI_GEAR_PRESENT) != 0;
+}
+
+bool dali_gear_level(uint8_t* level_out)
+{
+  bool known = false;
+  uint8_t level = 0;
+  dali_gear_lock();
+  for (uint32_t i = 0; i < array_size(g_gears); ++i)
+  {
+    const dali_gear_t* gear = &g_gears[i];
+    if ((gear->flags & DALI_GEAR_PRESENT) == 0)
+    {
+      continue;
+    }
+    if ((gear->flags & DALI_GEAR_CONFIRMED) &&
+        ((int32_t)(gear->confirmed_ms - gear->target_ms) >= 0))
+    {
+      level = max(level, gear->actual_level);
+    }
+    else if (gear->flags & DALI_GEAR_TARGET_KNOWN)
+    {
+      level = max(level, gear->target_level);
+    }
+    else
+    {
+      known = false;
+      break;
+    }
+    known = true;
+  }
+  dali_gear_unlock();
+
+  if (known && level_out) (*level_out) = level;
+  return known;
+}
+
+uint8_t dali_gear_min_level(uint8_t fallback)
+{
+  bool known = false;
+  uint8_t level = 0;
+  dali_gear_lock();
+  for (uint32_t i = 0; i < array_size(g_gears); ++i)
+  {
+    const dali_gear_t* gear = &g_gears[i];
+    if ((gear->flags & DALI_GEAR_PRESENT) && (gear->flags & DALI_GEAR_MIN_KNOWN))
+    {
+      level = max(level, gear->min_level);
+      known = true;
+    }
+  }
+  dali_gear_unlock();
+  return known ? level : fallback;
+}
+
+bool dali_gear_next_query(uint8_t* address_out, uint8_t* command_out)
+{
+  bool found = false;
+  dali_gear_lock();
+  for (uint32_t n = 0; n < array_size(g_gears); ++n)
+  {
+    uint32_t index = (g_next_gear + n) % DALI_GEAR_COUNT;
+    dali_gear_t* gear = &g_gears[index];
+    if ((gear->flags & DALI_GEAR_PRESENT) == 0)
+    {
+      continue;
+    }
+
+    uint8_t command = DALI_QUERY_ACTUAL_OUTPUT;
+    if ((gear->flags & DALI_GEAR_MIN_KNOWN) == 0)
+    {
+      command = DALI_QUERY_MIN_LEVEL;
+    }
+    else if ((gear->flags & DALI_GEAR_MAX_KNOWN) == 0)
+    {
+      command = DALI_QUERY_MAX_LEVEL;
+    }
+    else if ((gear->flags & DALI_GEAR_PHYSICAL_MIN_KNOWN) == 0)
+    {
+      command = DALI_QUERY_PHYSICAL_MINIMUM;
+    }
+    else if (((gear->flags & DALI_GEAR_CONFIRMED) == 0) ||
+             (gear->flags & DALI_GEAR_FADING) ||
+             ((int32_t)(gear->confirmed_ms - gear->target_ms) < 0))
+    {
+      command = DALI_QUERY_ACTUAL_OUTPUT;
+    }
+    else
+    {
+      static const uint8_t turns[] = {
+        DALI_QUERY_ACTUAL_OUTPUT,
+        DALI_QUERY_STATUS,
+        DALI_EX_QUERY_FAILURE_STATUS,
+      };
+      uint32_t turn_count = array_size(turns) - ((gear->flags & DALI_GEAR_NOT_LED) ? 1 : 0);
+      gear->poll_turn = (gear->poll_turn + 1) % turn_count;
+      command = turns[gear->poll_turn];
+    }
+
+    (*address_out) = (uint8_t)((index << 1) | 0x01);
+    (*command_out) = command;
+    g_next_gear = (uint8_t)((index + 1) % DALI_GEAR_COUNT);
+    found = true;
+    break;
+  }
+  dali_gear_unlock();
+  return found;
+}
+
+void dali_gear_reset(void)
+{
+  dali_gear_lock();
+  for (uint32_t i = 0; i < array_size(g_gears); ++i)
+  {
+    g_gears[i] = (dali_gear_t){};
+  }
+  g_dtr0 = -1;
+  dali_gear_unlock();
+}
+
+void dali_gear_set_present(uint8_t short_address)
+{
+  if (short_address >= DALI_GEAR_COUNT)
+  {
+    return;
+  }
+  dali_gear_lock();
+  g_gears[short_address].flags |= DALI_GEAR_PRESENT;
+  dali_gear_unlock();
+}
+
+void dali_gear_initialize(void)
+{
+  g_gear_lock = xSemaphoreCreateMutex();
+}
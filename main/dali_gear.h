@@ -0,0 +1,82 @@
+#ifndef DALI_GEAR_H
+#define DALI_GEAR_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// In-RAM model of every control gear on the bus, by short address. It is
+// updated from every forward frame this controller sends and from every
+// answer it gets, so control decisions and status reads can use it without
+// waiting for the bus. Background queries picked by dali_gear_next_query()
+// reconcile it with what the gear actually report.
+
+#define DALI_GEAR_COUNT 64
+
+typedef enum dali_gear_flag_t
+{
+  DALI_GEAR_PRESENT = 0x01,
+  DALI_GEAR_TARGET_KNOWN = 0x02,
+  DALI_GEAR_CONFIRMED = 0x04, // actual_level has been read back.
+  DALI_GEAR_FADING = 0x08,
+  DALI_GEAR_MIN_KNOWN = 0x10,
+  DALI_GEAR_MAX_KNOWN = 0x20,
+  DALI_GEAR_PHYSICAL_MIN_KNOWN = 0x40,
+  DALI_GEAR_STATUS_KNOWN = 0x80,
+  DALI_GEAR_FAILURE_KNOWN = 0x100,
+  DALI_GEAR_NOT_LED = 0x200, // No answer to DT6 extended queries.
+} dali_gear_flag_t;
+
+#define DALI_GEAR_LIMITS_KNOWN                                                       \
+  (DALI_GEAR_MIN_KNOWN | DALI_GEAR_MAX_KNOWN | DALI_GEAR_PHYSICAL_MIN_KNOWN)
+
+typedef struct dali_gear_t
+{
+  uint16_t flags;
+  uint8_t target_level;
+  uint8_t actual_level;
+  uint8_t min_level;
+  uint8_t max_level;
+  uint8_t physical_min;
+  uint8_t status;
+  uint8_t failure_status; // DT6 QUERY FAILURE STATUS.
+  uint8_t missed;         // Queries in a row without an answer.
+  uint8_t ex_missed;      // DT6 extended queries in a row without an answer.
+  uint8_t poll_turn;
+  uint32_t target_ms;    // When target_level was last commanded.
+  uint32_t confirmed_ms; // When actual_level was last read back.
+  uint32_t last_seen_ms; // Last answer of any kind.
+} dali_gear_t;
+
+void dali_gear_initialize(void);
+
+// Forgets every gear, e.g. before the bus is scanned again.
+void dali_gear_reset(void);
+void dali_gear_set_present(uint8_t short_address);
+
+// Called for every forward frame sent and every accepted answer. address is
+// the address byte of the frame.
+void dali_gear_sent(uint8_t address, uint8_t command);
+void dali_gear_answered(uint8_t address, uint8_t command, uint8_t response);
+void dali_gear_missed(uint8_t address, uint8_t command);
+
+bool dali_gear_get(uint8_t short_address, dali_gear_t* gear_out);
+
+/**
+ * Highest level among present gear: the confirmed level where it is newer
+ * than the last command, the commanded one otherwise. Returns false if any
+ * present gear has neither.
+ */
+bool dali_gear_level(uint8_t* level_out);
+
+// Highest minimum level among present gear, or fallback if none is known.
+uint8_t dali_gear_min_level(uint8_t fallback);
+
+/**
+ * Picks the next gear and query for background reconciliation and health
+ * polling, round robin: limits that were never read first, then the level
+ * while it is unconfirmed or fading, otherwise level, status and DT6 failure
+ * status in turn. Extended commands need ENABLE DEVICE TYPE 6 first. Returns
+ * false if no gear is present.
+ */
+bool dali_gear_next_query(uint8_t* address_out, uint8_t* command_out);
+
+#endif
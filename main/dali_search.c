@@ -0,0 +1,153 @@
+#include "dali_search.h"
+
+static const uint8_t g_search_commands[3] = {
+  DALI_SEARCHADDRL,
+  DALI_SEARCHADDRM,
+  DALI_SEARCHADDRH,
+};
+
+void dali_search_begin(dali_search_t* search, dali_search_send_t send,
+                       dali_search_compare_t compare, void* context)
+{
+  (*search) = (dali_search_t){};
+  search->send = send;
+  search->compare = compare;
+  search->context = context;
+}
+
+void dali_search_set_address(dali_search_t* search, uint32_t address)
+{
+  for (int32_t i = 2; i >= 0; --i)
+  {
+    uint32_t shift = (uint32_t)i * 8;
+    uint8_t value = (address >> shift) & 0xFF;
+    uint8_t bit = 1 << i;
+    if ((search->known & bit) && (((search->address >> shift) & 0xFF) == value))
+    {
+      search->skipped_frames++;
+      continue;
+    }
+
+    search->address = (search->address & ~(0xFFUL << shift)) | ((uint32_t)value << shift);
+    search->known |= bit;
+    if (!search->send(g_search_commands[i], value, search->context))
+    {
+      search->known &= ~bit;
+    }
+    search->address_frames++;
+  }
+}
+
+// Number of search address frames it takes to get the gear to address.
+static uint32_t dali_search_changes(const dali_search_t* search, uint32_t address)
+{
+  uint32_t changes = 0;
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    uint32_t shift = i * 8;
+    if (((search->known & (1 << i)) == 0) ||
+        (((search->address ^ address) >> shift) & 0xFF))
+    {
+      changes++;
+    }
+  }
+  return changes;
+}
+
+// A split point in the middle half of low..high that takes as few search
+// address frames as possible: the middle itself, or the middle with its low
+// bytes swapped for what the gear already have.
+static uint32_t dali_search_split(const dali_search_t* search, uint32_t low, uint32_t high)
+{
+  uint32_t middle = low + (high - low) / 2;
+  uint32_t quarter = (high - low) / 4;
+  uint32_t best = middle;
+  uint32_t best_changes = dali_search_changes(search, middle);
+  static const uint32_t masks[] = { 0xFF, 0xFFFF };
+  for (uint32_t i = 0; i < 2; ++i)
+  {
+    uint32_t candidate = (middle & ~masks[i]) | (search->address & masks[i]);
+    uint32_t changes = dali_search_changes(search, candidate);
+    if ((candidate >= (low + quarter)) && (candidate <= (high - quarter)) &&
+        (candidate < high) && (changes < best_changes))
+    {
+      best = candidate;
+      best_changes = changes;
+    }
+  }
+  return best;
+}
+
+static bool dali_search_compare_at(dali_search_t* search, uint32_t address)
+{
+  dali_search_set_address(search, address);
+  search->compares++;
+  return search->compare(search->context);
+}
+
+bool dali_search_lowest(dali_search_t* search, uint32_t* address_out)
+{
+  uint32_t low = search->low;
+  uint32_t high = DALI_SEARCH_ADDRESS_MAX;
+
+  // Random addresses are spread evenly, so the next gear is most likely
+  // within the average gap of those found so far. Step up from low by that
+  // gap, doubling it on every miss, and bisect once a step gets an answer.
+  if (search->found > 0)
+  {
+    uint32_t step = (low / search->found) + 1;
+    while (low < DALI_SEARCH_ADDRESS_MAX)
+    {
+      uint32_t probe = low + step - 1;
+      if (probe >= DALI_SEARCH_ADDRESS_MAX)
+      {
+        probe = DALI_SEARCH_ADDRESS_MAX - 1;
+      }
+      if (dali_search_compare_at(search, probe))
+      {
+        high = probe;
+        break;
+      }
+      low = probe + 1;
+      step *= 2;
+    }
+  }
+
+  while (high > low)
+  {
+    uint32_t current = dali_search_split(search, low, high);
+    if (dali_search_compare_at(search, current))
+    {
+      high = current;
+    }
+    else
+    {
+      low = current + 1;
+    }
+  }
+
+  // Nothing answered below the top address. COMPARE asks for a random address
+  // at or below the search address, so only a compare at the top itself tells
+  // a gear there from no gear at all.
+  if ((high == DALI_SEARCH_ADDRESS_MAX) && !dali_search_compare_at(search, high))
+  {
+    return false;
+  }
+
+  // Only answers all the way down to the start look the same as a gear that
+  // missed its WITHDRAW. If something answers below the start, search again
+  // from the bottom.
+  if ((high == search->low) && (search->low > 0) &&
+      dali_search_compare_at(search, search->low - 1))
+  {
+    search->low = 0;
+    search->found = 0;
+    return dali_search_lowest(search, address_out);
+  }
+
+  dali_search_set_address(search, high);
+  search->low = high + 1;
+  search->found++;
+  (*address_out) = high;
+  return true;
+}
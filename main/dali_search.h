@@ -0,0 +1,71 @@
+#ifndef DALI_SEARCH_H
+#define DALI_SEARCH_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// IEC 62386-102 random address search for commissioning. The bus is behind
+// the callbacks in dali_search_t, so the same search also runs against
+// simulated gear. It depends on nothing but the C library so it also builds
+// for the host.
+//
+// The search address the gear last received is tracked byte by byte, and a
+// new search address only sends the bytes that differ. Deep in a binary
+// search the high bytes rarely change.
+//
+// Gear are found in order of their random address. After one is withdrawn
+// the rest are all above it, so the next search starts there instead of
+// descending from the full range again.
+
+#define DALI_SEARCH_ADDRESS_MAX 0x00FFFFFF
+
+#define DALI_SEARCHADDRH 0xB1
+#define DALI_SEARCHADDRM 0xB3
+#define DALI_SEARCHADDRL 0xB5
+
+// Sends a special command frame, returns false if it may not have reached
+// the gear.
+typedef bool (*dali_search_send_t)(uint8_t address, uint8_t command, void* context);
+
+// Sends COMPARE, returns true if any gear answered.
+typedef bool (*dali_search_compare_t)(void* context);
+
+typedef struct dali_search_t
+{
+  dali_search_send_t send;
+  dali_search_compare_t compare;
+  void* context;
+
+  // Byte i of address is what the gear have if bit i of known is set.
+  uint32_t address;
+  uint8_t known;
+
+  // Every gear below low has been found and withdrawn.
+  uint32_t low;
+  uint32_t found;
+
+  uint32_t address_frames;
+  uint32_t skipped_frames;
+  uint32_t compares;
+} dali_search_t;
+
+void dali_search_begin(dali_search_t* search, dali_search_send_t send,
+                       dali_search_compare_t compare, void* context);
+
+// Sends the bytes of address the gear do not have yet, high byte first.
+void dali_search_set_address(dali_search_t* search, uint32_t address);
+
+/**
+ * Finds the lowest random address among gear still taking part, starting
+ * above the last one found. The search address is left at it, ready for
+ * PROGRAM SHORT ADDRESS and WITHDRAW, which the caller must send before the
+ * next search. Returns false if no gear answered.
+ */
+bool dali_search_lowest(dali_search_t* search, uint32_t* address_out);
+
+// The gear may have lost track, e.g. after a power cycle.
+static inline void dali_search_forget(dali_search_t* search)
+{
+  search->known = 0;
+}
+
+#endif
@@ -10,8 +10,22 @@
 #include "util.h"
 #include "platform.h"
 #include "dali.h"
+#include "dali_bus.h"
+#include "dali_gear.h"
 #include "version.h"
 
+// Binary bus capture download: this header followed by dali_capture_t
+// records, all little endian.
+typedef struct capture_header_t
+{
+  char magic[4];
+  uint8_t version;
+  uint8_t record_size;
+  uint16_t record_count_max;
+  uint32_t now_us;
+  uint32_t dropped;
+} capture_header_t;
+
 static string32_t yuno = {};
 static string32_t detail = {};
 
@@ -26,6 +40,10 @@ static httpd_uri_t update_page_uri = {};
 static httpd_uri_t set_brightness_page_uri = {};
 static httpd_uri_t set_brightness_uri = {};
 static httpd_uri_t set_wifi_uri = {};
+static httpd_uri_t capture_uri = {};
+static httpd_uri_t gear_uri = {};
+static httpd_uri_t commission_uri = {};
+static httpd_uri_t commission_progress_uri = {};
 
 static uint32_t g_log_pointer = 0;
 static char g_log_buffer[6 * 1024] = {};
@@ -138,9 +156,22 @@ void set_home_page(void)
     "<button onclick=\"window.location.href='/updatePage'\">Update Firmware</button>\n");
   add_home_html(
     "<button onclick=\"window.location.href='/wifiPage'\">Wifi Config</button>\n");
+  add_home_html("<button onclick='commissionNewGear()'>Add New Gear</button>\n");
+  add_home_html("<div id='commission'></div>\n");
   add_home_html("</div>\n");
 
   add_home_html("<script>\n");
+  add_home_html(
+    "function showCommission() { fetch('/commission').then(r => r.json()).then(j => {"
+    " document.getElementById('commission').textContent = j.running ?"
+    " 'Commissioning ' + j.percent + '%, ' + j.found + ' found' :"
+    " j.gear_count + ' gear addressed'"
+    " + (j.missing ? ', ' + j.missing + ' not answering' : '');"
+    " if (j.running) setTimeout(showCommission, 1000); }); }\n");
+  add_home_html(
+    "function commissionNewGear() { fetch('/commission', { method: 'POST' })"
+    ".then(() => showCommission()); }\n");
+  add_home_html("showCommission();\n");
   add_home_html("</script>\n");
 
   add_home_html("</body></html>\n");
@@ -635,6 +666,114 @@ esp_err_t log_handler(httpd_req_t* req)
   return ESP_OK;
 }
 
+// GET /capture drains the bus capture ring; ?monitor=1 or 0 switches monitor
+// mode on or off first.
+esp_err_t capture_handler(httpd_req_t* req)
+{
+  char query[32] = {};
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+  {
+    char param[4] = {};
+    if (httpd_query_key_value(query, "monitor", param, sizeof(param)) == ESP_OK)
+    {
+      dali_bus_set_monitor(atoi(param) != 0);
+    }
+  }
+
+  dali_bus_stats_t stats = {};
+  dali_bus_get_stats(&stats);
+
+  const uint32_t record_count_max = DALI_BUS_CAPTURE_COUNT;
+  capture_header_t header = {};
+  memcpy(header.magic, "DCAP", sizeof(header.magic));
+  header.version = 1;
+  header.record_size = sizeof(dali_capture_t);
+  header.record_count_max = record_count_max;
+  header.now_us = lsx_get_micro();
+  header.dropped = stats.captures_dropped;
+
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_send_chunk(req, (const char*)&header, sizeof(header));
+
+  // Bounded so a busy bus cannot keep the request open forever.
+  dali_capture_t captures[32] = {};
+  uint32_t total = 0;
+  while (total < record_count_max)
+  {
+    uint32_t count = dali_bus_read_captures(captures, array_size(captures));
+    if (count == 0)
+    {
+      break;
+    }
+    httpd_resp_send_chunk(req, (const char*)captures, count * sizeof(dali_capture_t));
+    total += count;
+  }
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+// GET /gear lists the gear model and health as JSON. It is read from RAM
+// only, the background queries keep it current.
+esp_err_t gear_handler(httpd_req_t* req)
+{
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send_chunk(req, "[", 1);
+  bool first = true;
+  for (uint8_t i = 0; i < DALI_GEAR_COUNT; ++i)
+  {
+    dali_gear_t gear = {};
+    if (!dali_gear_get(i, &gear))
+    {
+      continue;
+    }
+    // Timestamps are in lsx_get_millis() time; seen_ago_ms saves the reader
+    // from knowing the device clock.
+    uint32_t seen_ago_ms = gear.last_seen_ms ? (lsx_get_millis() - gear.last_seen_ms) : 0;
+    char line[320] = {};
+    int32_t length = snprintf(
+      line, sizeof(line),
+      "%s{\"address\":%u,\"flags\":%u,\"target\":%u,\"actual\":%u,\"min\":%u,"
+      "\"max\":%u,\"physical_min\":%u,\"status\":%u,\"failure_status\":%u,"
+      "\"missed\":%u,\"target_ms\":%lu,\"confirmed_ms\":%lu,\"last_seen_ms\":%lu,"
+      "\"seen_ago_ms\":%lu}",
+      first ? "" : ",", i, gear.flags, gear.target_level, gear.actual_level,
+      gear.min_level, gear.max_level, gear.physical_min, gear.status,
+      gear.failure_status, gear.missed, gear.target_ms, gear.confirmed_ms,
+      gear.last_seen_ms, seen_ago_ms);
+    httpd_resp_send_chunk(req, line, min(length, sizeof(line) - 1));
+    first = false;
+  }
+  httpd_resp_send_chunk(req, "]", 1);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+// POST /commission addresses gear without a short address in the background,
+// leaving every existing address alone.
+esp_err_t commission_handler(httpd_req_t* req)
+{
+  bool started = dali_commission_new_gear();
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_sendstr(req, started ? "{\"started\":true}" : "{\"started\":false}");
+  return ESP_OK;
+}
+
+// GET /commission reports how far commissioning has got.
+esp_err_t commission_progress_handler(httpd_req_t* req)
+{
+  dali_commission_progress_t progress = {};
+  dali_get_commission_progress(&progress);
+  char json[160] = {};
+  snprintf(json, sizeof(json),
+           "{\"running\":%s,\"all_gear\":%s,\"percent\":%u,\"found\":%lu,"
+           "\"gear_count\":%lu,\"missing\":%lu}",
+           progress.running ? "true" : "false", progress.all_gear ? "true" : "false",
+           progress.percent, progress.found, progress.gear_count, progress.missing);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_sendstr(req, json);
+  return ESP_OK;
+}
+
 esp_err_t root_get_handler(httpd_req_t* request)
 {
   httpd_resp_send(request, home_page_html_buffer, home_page_buffer_pointer);
@@ -893,7 +1032,24 @@ esp_err_t start_webserver(void)
   log_uri.method = HTTP_GET;
   log_uri.handler = log_handler;
 
+  capture_uri.uri = "/capture";
+  capture_uri.method = HTTP_GET;
+  capture_uri.handler = capture_handler;
+
+  gear_uri.uri = "/gear";
+  gear_uri.method = HTTP_GET;
+  gear_uri.handler = gear_handler;
+
+  commission_uri.uri = "/commission";
+  commission_uri.method = HTTP_POST;
+  commission_uri.handler = commission_handler;
+
+  commission_progress_uri.uri = "/commission";
+  commission_progress_uri.method = HTTP_GET;
+  commission_progress_uri.handler = commission_progress_handler;
+
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.max_uri_handlers = 16;
   httpd_start(&server, &config);
   httpd_register_uri_handler(server, &log_uri);
   httpd_register_uri_handler(server, &wifi_uri);
@@ -903,6 +1059,10 @@ esp_err_t start_webserver(void)
   httpd_register_uri_handler(server, &update_uri);
   httpd_register_uri_handler(server, &set_brightness_page_uri);
   httpd_register_uri_handler(server, &set_brightness_uri);
+  httpd_register_uri_handler(server, &capture_uri);
+  httpd_register_uri_handler(server, &gear_uri);
+  httpd_register_uri_handler(server, &commission_uri);
+  httpd_register_uri_handler(server, &commission_progress_uri);
   return ESP_OK;
 }
 
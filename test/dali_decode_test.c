@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "dali_decode.h"
+#include "dali_decode_traces.h"
+
+// Host tests for the streaming Manchester decoder, fed receiver traces the
+// way dali_bus_decode() feeds it RMT symbols.
+
+#define DALI_TEST_HALF_BIT_US 416
+
+#define DALI_BENCHMARK_ROUNDS 20000
+
+static uint32_t g_failures = 0;
+
+#define check(condition, ...)                                                      \
+  do                                                                               \
+  {                                                                                \
+    if (!(condition))                                                              \
+    {                                                                              \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__);                                  \
+      printf(__VA_ARGS__);                                                         \
+      printf("\n");                                                                \
+      g_failures++;                                                                \
+    }                                                                              \
+  } while (0)
+
+// pieces > 1 splits every level into that many pushes, which the decoder has
+// to merge back into one run.
+static dali_decode_result_t dali_test_decode(const dali_trace_t* trace,
+                                             uint32_t pieces, dali_decoder_t* decoder)
+{
+  dali_decoder_begin(decoder, DALI_TEST_HALF_BIT_US);
+  for (uint32_t i = 0; i < trace->symbol_count; ++i)
+  {
+    const dali_trace_symbol_t* symbol = &trace->symbols[i];
+    for (uint32_t p = 0; p < pieces; ++p)
+    {
+      uint32_t part0 = symbol->duration0 / pieces;
+      if (p == 0)
+      {
+        part0 += symbol->duration0 % pieces;
+      }
+      dali_decoder_push(decoder, symbol->level0, part0);
+    }
+    for (uint32_t p = 0; p < pieces; ++p)
+    {
+      uint32_t part1 = symbol->duration1 / pieces;
+      if (p == 0)
+      {
+        part1 += symbol->duration1 % pieces;
+      }
+      dali_decoder_push(decoder, symbol->level1, part1);
+    }
+  }
+  return dali_decoder_end(decoder);
+}
+
+static void dali_test_traces(uint32_t pieces)
+{
+  for (uint32_t i = 0; i < sizeof(g_traces) / sizeof(g_traces[0]); ++i)
+  {
+    const dali_trace_t* trace = &g_traces[i];
+    dali_decoder_t decoder;
+    dali_decode_result_t result = dali_test_decode(trace, pieces, &decoder);
+    check(result == trace->result, "%s: result %u, expected %u", trace->name, result,
+          trace->result);
+    check(decoder.bits == trace->bits, "%s: %u bits, expected %u", trace->name,
+          decoder.bits, trace->bits);
+    check(decoder.data == trace->data, "%s: data 0x%X, expected 0x%X", trace->name,
+          decoder.data, trace->data);
+  }
+}
+
+static void dali_test_silence(void)
+{
+  dali_decoder_t decoder;
+  dali_decoder_begin(&decoder, DALI_TEST_HALF_BIT_US);
+  check(dali_decoder_end(&decoder) == DALI_DECODE_SILENCE, "empty reception");
+
+  // Idle alone is no frame either.
+  dali_decoder_begin(&decoder, DALI_TEST_HALF_BIT_US);
+  dali_decoder_push(&decoder, 0, 5000);
+  check(dali_decoder_end(&decoder) == DALI_DECODE_SILENCE, "idle reception");
+}
+
+// The backward frame calibration follows the measured half bit.
+static void dali_test_half_bit(void)
+{
+  const struct
+  {
+    const dali_trace_symbol_t* symbols;
+    uint32_t symbol_count;
+    uint32_t half_bit_us;
+  } cases[] = {
+    { g_trace_backward_slow_gear, sizeof(g_trace_backward_slow_gear) /
+                                    sizeof(g_trace_backward_slow_gear[0]), 480 },
+    { g_trace_backward_fast_gear, sizeof(g_trace_backward_fast_gear) /
+                                    sizeof(g_trace_backward_fast_gear[0]), 350 },
+    { g_trace_forward_nominal, sizeof(g_trace_forward_nominal) /
+                                 sizeof(g_trace_forward_nominal[0]), 416 },
+  };
+  for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    dali_trace_t trace = { "half bit", cases[i].symbols, cases[i].symbol_count,
+                           0, 0, 0 };
+    dali_decoder_t decoder;
+    dali_test_decode(&trace, 1, &decoder);
+    uint32_t measured_us = dali_decoder_half_bit_us(&decoder);
+    check((measured_us + 10 >= cases[i].half_bit_us) &&
+            (measured_us <= cases[i].half_bit_us + 10),
+          "half bit %u us, expected %u us", measured_us, cases[i].half_bit_us);
+  }
+}
+
+static void dali_benchmark_traces(void)
+{
+  struct timespec start;
+  struct timespec end;
+  volatile uint32_t sink = 0;
+  uint32_t trace_count = sizeof(g_traces) / sizeof(g_traces[0]);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t n = 0; n < DALI_BENCHMARK_ROUNDS; ++n)
+  {
+    for (uint32_t i = 0; i < trace_count; ++i)
+    {
+      dali_decoder_t decoder;
+      sink += dali_test_decode(&g_traces[i], 1, &decoder);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed_ns = ((double)(end.tv_sec - start.tv_sec) * 1e9) +
+                      (double)(end.tv_nsec - start.tv_nsec);
+  printf("Decode: %.0f ns per trace over %u traces (%u)\n",
+         elapsed_ns / ((double)DALI_BENCHMARK_ROUNDS * trace_count), trace_count,
+         sink & 1);
+}
+
+int main(void)
+{
+  dali_test_traces(1);
+  dali_test_traces(3);
+  dali_test_silence();
+  dali_test_half_bit();
+  dali_benchmark_traces();
+
+  if (g_failures > 0)
+  {
+    printf("%u failures\n", g_failures);
+    return 1;
+  }
+  printf("All decoder tests passed\n");
+  return 0;
+}
@@ -0,0 +1,180 @@
+#ifndef DALI_DECODE_TRACES_H
+#define DALI_DECODE_TRACES_H
+#include <stdint.h>
+
+// Receiver traces in the layout the RMT receive channel hands over: pairs of
+// levels with their durations in us, 1 for an active bus. A reception starts
+// at the first active edge and ends with a zero duration once the line has
+// been idle for the RX idle time.
+//
+// The traces model the line as the transceiver shows it: wired-AND for
+// several senders, edges jittered around the half-bit grid and active levels
+// stretched by slow releases. Captures from a real bus, e.g. from monitor
+// mode, can be added the same way.
+
+typedef struct dali_trace_symbol_t
+{
+  uint8_t level0;
+  uint16_t duration0;
+  uint8_t level1;
+  uint16_t duration1;
+} dali_trace_symbol_t;
+
+typedef struct dali_trace_t
+{
+  const char* name;
+  const dali_trace_symbol_t* symbols;
+  uint32_t symbol_count;
+  uint8_t result;
+  uint32_t data;
+  uint8_t bits;
+} dali_trace_t;
+
+// 16-bit forward frame, nominal timing.
+static const dali_trace_symbol_t g_trace_forward_nominal[] = {
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 832 }, { 1, 416, 0, 416 }, { 1, 832, 0, 832 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 0 },
+};
+
+// 16-bit forward frame, edges jittered by up to 40 us.
+static const dali_trace_symbol_t g_trace_forward_jitter[] = {
+  { 1, 406, 0, 871 }, { 1, 363, 0, 447 }, { 1, 446, 0, 399 }, { 1, 436, 0, 410 },
+  { 1, 350, 0, 485 }, { 1, 340, 0, 475 }, { 1, 389, 0, 453 }, { 1, 786, 0, 877 },
+  { 1, 417, 0, 406 }, { 1, 406, 0, 385 }, { 1, 426, 0, 406 }, { 1, 463, 0, 399 },
+  { 1, 791, 0, 899 }, { 1, 795, 0, 0 },
+};
+
+// 24-bit input device event.
+static const dali_trace_symbol_t g_trace_forward_event[] = {
+  { 1, 435, 0, 393 }, { 1, 422, 0, 811 }, { 1, 444, 0, 402 }, { 1, 404, 0, 423 },
+  { 1, 845, 0, 423 }, { 1, 401, 0, 425 }, { 1, 426, 0, 388 }, { 1, 446, 0, 395 },
+  { 1, 401, 0, 429 }, { 1, 429, 0, 407 }, { 1, 410, 0, 429 }, { 1, 402, 0, 410 },
+  { 1, 420, 0, 447 }, { 1, 416, 0, 405 }, { 1, 396, 0, 824 }, { 1, 416, 0, 429 },
+  { 1, 416, 0, 413 }, { 1, 416, 0, 424 }, { 1, 826, 0, 860 }, { 1, 389, 0, 414 },
+  { 1, 845, 0, 809 }, { 1, 438, 0, 0 },
+};
+
+// Active levels stretched by 70 us, as after a slow transceiver.
+static const dali_trace_symbol_t g_trace_forward_slow_release[] = {
+  { 1, 486, 0, 346 }, { 1, 486, 0, 762 }, { 1, 902, 0, 762 }, { 1, 486, 0, 346 },
+  { 1, 902, 0, 762 }, { 1, 902, 0, 346 }, { 1, 486, 0, 346 }, { 1, 486, 0, 762 },
+  { 1, 486, 0, 346 }, { 1, 486, 0, 346 }, { 1, 486, 0, 346 }, { 1, 902, 0, 346 },
+  { 1, 486, 0, 0 },
+};
+
+// Backward frame from gear running at a 480 us half bit.
+static const dali_trace_symbol_t g_trace_backward_slow_gear[] = {
+  { 1, 480, 0, 965 }, { 1, 939, 0, 962 }, { 1, 991, 0, 446 }, { 1, 509, 0, 930 },
+  { 1, 985, 0, 937 }, { 1, 491, 0, 0 },
+};
+
+// Backward frame from gear running at a 350 us half bit.
+static const dali_trace_symbol_t g_trace_backward_fast_gear[] = {
+  { 1, 349, 0, 355 }, { 1, 342, 0, 347 }, { 1, 346, 0, 723 }, { 1, 344, 0, 329 },
+  { 1, 360, 0, 356 }, { 1, 348, 0, 364 }, { 1, 674, 0, 358 }, { 1, 357, 0, 0 },
+};
+
+// Backward frame at the 495 us end of the receiver window.
+static const dali_trace_symbol_t g_trace_backward_spec_limit[] = {
+  { 1, 495, 0, 495 }, { 1, 495, 0, 990 }, { 1, 495, 0, 495 }, { 1, 990, 0, 990 },
+  { 1, 990, 0, 495 }, { 1, 495, 0, 990 }, { 1, 495, 0, 0 },
+};
+
+// Two gear answering 0xFF and 0x00 at once.
+static const dali_trace_symbol_t g_trace_backward_two_gear[] = {
+  { 1, 416, 0, 416 }, { 1, 6656, 0, 0 },
+};
+
+// Two gear answering 0xFF, 150 us apart.
+static const dali_trace_symbol_t g_trace_backward_two_gear_offset[] = {
+  { 1, 566, 0, 266 }, { 1, 566, 0, 266 }, { 1, 566, 0, 266 }, { 1, 566, 0, 266 },
+  { 1, 566, 0, 266 }, { 1, 566, 0, 266 }, { 1, 566, 0, 266 }, { 1, 566, 0, 266 },
+  { 1, 566, 0, 0 },
+};
+
+// Two masters starting together, first difference in bit 8. The levels stay
+// on the half-bit grid, only the Manchester coding breaks.
+static const dali_trace_symbol_t g_trace_forward_two_masters[] = {
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 832, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 0 },
+};
+
+// Two masters 180 us apart.
+static const dali_trace_symbol_t g_trace_forward_two_masters_offset[] = {
+  { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 },
+  { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 },
+  { 1, 416, 0, 180 }, { 1, 416, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 },
+  { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 }, { 1, 596, 0, 236 },
+  { 1, 596, 0, 236 }, { 1, 596, 0, 0 },
+};
+
+// Forward frame cut off after 11 bits.
+static const dali_trace_symbol_t g_trace_forward_truncated[] = {
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 832 }, { 1, 416, 0, 416 }, { 1, 416, 0, 0 },
+};
+
+// Forward frame whose start bit was missed.
+static const dali_trace_symbol_t g_trace_forward_no_start_bit[] = {
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 832 }, { 1, 416, 0, 416 }, { 1, 832, 0, 832 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 0 },
+};
+
+// Two frames 2.5 ms apart in one reception.
+static const dali_trace_symbol_t g_trace_two_frames[] = {
+  { 1, 416, 0, 832 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 832, 0, 832 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 832, 0, 2916 }, { 1, 416, 0, 832 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 832, 0, 832 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 832, 0, 832 }, { 1, 416, 0, 0 },
+};
+
+// 20 us spike in the idle half of the start bit.
+static const dali_trace_symbol_t g_trace_idle_glitch[] = {
+  { 1, 416, 0, 200 }, { 1, 20, 0, 196 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 832 }, { 1, 416, 0, 416 },
+  { 1, 832, 0, 832 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 }, { 1, 416, 0, 416 },
+  { 1, 416, 0, 0 },
+};
+
+// 1.3 ms break sent after a collision.
+static const dali_trace_symbol_t g_trace_break_condition[] = {
+  { 1, 1300, 0, 0 },
+};
+
+#define dali_trace(name, result, data, bits)                                         \
+  { #name, g_trace_##name, sizeof(g_trace_##name) / sizeof(g_trace_##name[0]),      \
+    (result), (data), (bits) }
+
+static const dali_trace_t g_traces[] = {
+  dali_trace(forward_nominal, DALI_DECODE_FRAME, 0xFF90, 16),
+  dali_trace(forward_jitter, DALI_DECODE_FRAME, 0x0105, 16),
+  dali_trace(forward_event, DALI_DECODE_FRAME, 0x8FFE12, 24),
+  dali_trace(forward_slow_release, DALI_DECODE_FRAME, 0xA5C3, 16),
+  dali_trace(backward_slow_gear, DALI_DECODE_FRAME, 0x5A, 8),
+  dali_trace(backward_fast_gear, DALI_DECODE_FRAME, 0xC3, 8),
+  dali_trace(backward_spec_limit, DALI_DECODE_FRAME, 0x96, 8),
+  dali_trace(backward_two_gear, DALI_DECODE_COLLISION, 0, 0),
+  dali_trace(backward_two_gear_offset, DALI_DECODE_COLLISION, 0, 0),
+  dali_trace(forward_two_masters, DALI_DECODE_FRAMING_ERROR, 0, 0),
+  dali_trace(forward_two_masters_offset, DALI_DECODE_COLLISION, 0, 0),
+  dali_trace(forward_truncated, DALI_DECODE_FRAMING_ERROR, 0, 0),
+  dali_trace(forward_no_start_bit, DALI_DECODE_FRAMING_ERROR, 0, 0),
+  dali_trace(two_frames, DALI_DECODE_FRAMING_ERROR, 0, 0),
+  dali_trace(idle_glitch, DALI_DECODE_COLLISION, 0, 0),
+  dali_trace(break_condition, DALI_DECODE_COLLISION, 0, 0),
+};
+
+#endif
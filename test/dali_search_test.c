@@ -0,0 +1,320 @@
+#include <stdio.h>
+
+#include "dali_search.h"
+
+// Host tests for the commissioning address search against simulated gear.
+// Every population is drawn from a fixed seed, so a run is repeatable.
+
+#define DALI_TEST_GEAR_MAX 64
+
+static uint32_t g_failures = 0;
+
+#define check(condition, ...)                                                      \
+  do                                                                               \
+  {                                                                                \
+    if (!(condition))                                                              \
+    {                                                                              \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__);                                  \
+      printf(__VA_ARGS__);                                                         \
+      printf("\n");                                                                \
+      g_failures++;                                                                \
+    }                                                                              \
+  } while (0)
+
+// Gear see the same frames, so one search address register stands in for
+// all of them. It holds whatever the last run left in it.
+typedef struct dali_test_bus_t
+{
+  uint32_t random_address[DALI_TEST_GEAR_MAX];
+  bool withdrawn[DALI_TEST_GEAR_MAX];
+  uint32_t gear_count;
+  uint32_t search_address;
+  uint32_t frames;
+
+  // Every miss_every-th WITHDRAW does not reach the gear, 0 for never.
+  uint32_t miss_every;
+  uint32_t withdraws;
+} dali_test_bus_t;
+
+static uint32_t dali_test_random(uint32_t* state)
+{
+  uint32_t x = (*state);
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return (*state) = x;
+}
+
+static void dali_test_populate(dali_test_bus_t* bus, uint32_t gear_count,
+                               uint32_t seed)
+{
+  (*bus) = (dali_test_bus_t){};
+  bus->gear_count = gear_count;
+  bus->search_address = dali_test_random(&seed) & DALI_SEARCH_ADDRESS_MAX;
+  for (uint32_t i = 0; i < gear_count; ++i)
+  {
+    bool unique = false;
+    while (!unique)
+    {
+      bus->random_address[i] = dali_test_random(&seed) & DALI_SEARCH_ADDRESS_MAX;
+      unique = true;
+      for (uint32_t j = 0; j < i; ++j)
+      {
+        unique = unique && (bus->random_address[j] != bus->random_address[i]);
+      }
+    }
+  }
+}
+
+static bool dali_test_send(uint8_t address, uint8_t command, void* context)
+{
+  dali_test_bus_t* bus = (dali_test_bus_t*)context;
+  uint32_t shift = 0;
+  switch (address)
+  {
+    case DALI_SEARCHADDRH:
+    {
+      shift = 16;
+      break;
+    }
+    case DALI_SEARCHADDRM:
+    {
+      shift = 8;
+      break;
+    }
+    default: break;
+  }
+  bus->search_address =
+    (bus->search_address & ~(0xFFUL << shift)) | ((uint32_t)command << shift);
+  bus->frames++;
+  return true;
+}
+
+static bool dali_test_compare(void* context)
+{
+  dali_test_bus_t* bus = (dali_test_bus_t*)context;
+  bus->frames++;
+  for (uint32_t i = 0; i < bus->gear_count; ++i)
+  {
+    if (!bus->withdrawn[i] && (bus->random_address[i] <= bus->search_address))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// WITHDRAW: the gear whose random address equals the search address.
+static void dali_test_withdraw(dali_test_bus_t* bus)
+{
+  bus->frames++;
+  if ((bus->miss_every > 0) && (((++bus->withdraws) % bus->miss_every) == 0))
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < bus->gear_count; ++i)
+  {
+    if (bus->random_address[i] == bus->search_address)
+    {
+      bus->withdrawn[i] = true;
+    }
+  }
+}
+
+// Lowest random address of gear still taking part, DALI_SEARCH_ADDRESS_MAX + 1
+// if none.
+static uint32_t dali_test_lowest(const dali_test_bus_t* bus)
+{
+  uint32_t lowest = DALI_SEARCH_ADDRESS_MAX + 1;
+  for (uint32_t i = 0; i < bus->gear_count; ++i)
+  {
+    if (!bus->withdrawn[i] && (bus->random_address[i] < lowest))
+    {
+      lowest = bus->random_address[i];
+    }
+  }
+  return lowest;
+}
+
+static bool dali_test_is_found(const uint32_t* found, uint32_t found_count,
+                               uint32_t address)
+{
+  for (uint32_t i = 0; i < found_count; ++i)
+  {
+    if (found[i] == address)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs the search the way dali_scan() does, for up to limit gear: a gear found
+// again after a missed WITHDRAW only gets the WITHDRAW again. Every gear has
+// to come out in order of its random address. Returns the gear found.
+static uint32_t dali_test_search(dali_test_bus_t* bus, dali_search_t* search,
+                                 uint32_t* found, uint32_t found_count,
+                                 uint32_t limit, const char* name)
+{
+  uint32_t address = 0;
+  uint32_t rounds = 0;
+  while ((found_count < limit) && dali_search_lowest(search, &address))
+  {
+    uint32_t expected = dali_test_lowest(bus);
+    check(address == expected, "%s: found 0x%06X, expected 0x%06X", name, address,
+          expected);
+    check(bus->search_address == address, "%s: search address 0x%06X left at 0x%06X",
+          name, address, bus->search_address);
+    if (!dali_test_is_found(found, found_count, address))
+    {
+      found[found_count++] = address;
+    }
+    dali_test_withdraw(bus);
+    if ((++rounds) > (2 * DALI_TEST_GEAR_MAX))
+    {
+      check(false, "%s: search does not end", name);
+      break;
+    }
+  }
+  return found_count;
+}
+
+static void dali_test_check_all_found(const dali_test_bus_t* bus,
+                                      uint32_t found_count, const char* name)
+{
+  check(found_count == bus->gear_count, "%s: %u of %u gear found", name, found_count,
+        bus->gear_count);
+  check(dali_test_lowest(bus) > DALI_SEARCH_ADDRESS_MAX, "%s: gear left behind",
+        name);
+}
+
+static void dali_test_population(uint32_t gear_count, uint32_t seed)
+{
+  char name[48];
+  snprintf(name, sizeof(name), "%u gear, seed 0x%X", gear_count, seed);
+  dali_test_bus_t bus;
+  dali_test_populate(&bus, gear_count, seed);
+  dali_search_t search;
+  dali_search_begin(&search, dali_test_send, dali_test_compare, &bus);
+
+  uint32_t found[DALI_TEST_GEAR_MAX];
+  uint32_t found_count =
+    dali_test_search(&bus, &search, found, 0, DALI_TEST_GEAR_MAX, name);
+  dali_test_check_all_found(&bus, found_count, name);
+
+  // Sending all three bytes for every search address is the baseline.
+  uint32_t every_byte = search.address_frames + search.skipped_frames;
+  check((every_byte % 3) == 0, "%u address frames sent or skipped", every_byte);
+  check((search.address_frames * 2) < every_byte,
+        "%s: %u address frames, %u with every byte", name, search.address_frames,
+        every_byte);
+  printf("%s: %4u compares, %4u address frames of %4u, %4u frames\n", name,
+         search.compares, search.address_frames, every_byte, bus.frames);
+}
+
+// Random addresses at both ends of the range and right next to each other.
+static void dali_test_edges(void)
+{
+  static const uint32_t addresses[] = {
+    0x000000, 0x000001, 0x7FFFFF, 0x800000, 0xFFFFFE, DALI_SEARCH_ADDRESS_MAX,
+  };
+  const uint32_t count = sizeof(addresses) / sizeof(addresses[0]);
+  for (uint32_t n = 1; n <= count; ++n)
+  {
+    // The last n addresses, so the top one is in every run.
+    char name[48];
+    snprintf(name, sizeof(name), "top %u edge addresses", n);
+    dali_test_bus_t bus = {};
+    bus.gear_count = n;
+    bus.search_address = 0x123456;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+      bus.random_address[i] = addresses[count - n + i];
+    }
+    dali_search_t search;
+    dali_search_begin(&search, dali_test_send, dali_test_compare, &bus);
+    uint32_t found[DALI_TEST_GEAR_MAX];
+    dali_test_check_all_found(&bus,
+                              dali_test_search(&bus, &search, found, 0,
+                                               DALI_TEST_GEAR_MAX, name),
+                              name);
+  }
+}
+
+// No gear lost on a full bus while WITHDRAW frames go missing.
+static void dali_test_missed_withdraw(uint32_t seed)
+{
+  char name[48];
+  snprintf(name, sizeof(name), "64 gear, missed WITHDRAW, seed 0x%X", seed);
+  dali_test_bus_t bus;
+  dali_test_populate(&bus, DALI_TEST_GEAR_MAX, seed);
+  bus.miss_every = 7;
+  dali_search_t search;
+  dali_search_begin(&search, dali_test_send, dali_test_compare, &bus);
+  uint32_t found[DALI_TEST_GEAR_MAX];
+  dali_test_check_all_found(&bus,
+                            dali_test_search(&bus, &search, found, 0,
+                                             DALI_TEST_GEAR_MAX, name),
+                            name);
+}
+
+// A reset halfway: the gear take part again after INITIALISE, those found are
+// withdrawn by their stored random address, and the search carries on above
+// the last one, as dali_commission() resumes a job.
+static void dali_test_resume(uint32_t seed)
+{
+  char name[48];
+  snprintf(name, sizeof(name), "64 gear, resumed, seed 0x%X", seed);
+  dali_test_bus_t bus;
+  dali_test_populate(&bus, DALI_TEST_GEAR_MAX, seed);
+  dali_search_t search;
+  dali_search_begin(&search, dali_test_send, dali_test_compare, &bus);
+  uint32_t found[DALI_TEST_GEAR_MAX];
+  uint32_t found_count = dali_test_search(&bus, &search, found, 0, 29, name);
+  check(found_count == 29, "%s: %u found before the reset", name, found_count);
+
+  uint32_t low = search.low;
+  dali_search_begin(&search, dali_test_send, dali_test_compare, &bus);
+  search.low = low;
+  search.found = found_count;
+  for (uint32_t i = 0; i < bus.gear_count; ++i)
+  {
+    bus.withdrawn[i] = false;
+  }
+  for (uint32_t i = 0; i < found_count; ++i)
+  {
+    dali_search_set_address(&search, found[i]);
+    dali_test_withdraw(&bus);
+  }
+
+  found_count =
+    dali_test_search(&bus, &search, found, found_count, DALI_TEST_GEAR_MAX, name);
+  dali_test_check_all_found(&bus, found_count, name);
+}
+
+int main(void)
+{
+  static const uint32_t populations[] = { 1, 4, 16, 64 };
+  static const uint32_t seeds[] = { 1, 0x2545F491, 0xDA1 };
+  for (uint32_t i = 0; i < sizeof(populations) / sizeof(populations[0]); ++i)
+  {
+    for (uint32_t j = 0; j < sizeof(seeds) / sizeof(seeds[0]); ++j)
+    {
+      dali_test_population(populations[i], seeds[j]);
+    }
+  }
+  dali_test_edges();
+  for (uint32_t j = 0; j < sizeof(seeds) / sizeof(seeds[0]); ++j)
+  {
+    dali_test_missed_withdraw(seeds[j]);
+    dali_test_resume(seeds[j]);
+  }
+
+  if (g_failures > 0)
+  {
+    printf("%u failures\n", g_failures);
+    return 1;
+  }
+  printf("All search tests passed\n");
+  return 0;
+}